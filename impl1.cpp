@@ -3,13 +3,16 @@
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
+#include <string.h>
 #include "include/timer.hpp"
+#include "include/arena.hpp"
+#include "include/bitmap.hpp"
+#include "include/chunk_search.hpp"
+#include "include/pma_policy.hpp"
 #include <iostream>
 
 // WARNING: Do not change this.
-#define VAL_C 2
-#define VAL_T_L 0.5
-#define VAL_T_0 1.0
 #define ELEM_EXISTS_AT(i) exists[i]
 #define OPTIMIZE 1 
 #define CAPACITY_AT(l) ((int)(segment_size<<l))
@@ -17,14 +20,17 @@
 
 typedef unsigned int uint32;
 
-template <class E> 
+// 'Density' gives the upper thresholds (for level 0 and level l) and
+// the growth factor, and 'Geometry' the segment size (see
+// include/pma_policy.hpp).
+template <class E, class Density = default_density, class Geometry = default_geometry>
 class PackedMemoryArray {
     // The actual array
-    std::vector<E> store;
+    std::vector<E, arena_allocator<E> > store;
     // A bitmask to check if an element exists or not
-    std::vector<bool> exists;
-    // Upper thresholds for the level 0, and level l
-    double t_0, t_l;
+    bitmap exists;
+    // Most elements each level may hold, for the current store size
+    density_limits limits;
     // The space requirement for n elements would be cn
     // NOTE: c should be a power of 2 for easier math
     int c;
@@ -33,7 +39,7 @@ class PackedMemoryArray {
     // Number of elements in the PMA (the size)
     uint32 s;
     // Segment size
-    // Basically round up log2(n) to a power of 2
+    // Basically round log2(n) to a power of 2 (see Geometry)
     int segment_size;
     // Total number of moves
     int total_moves;
@@ -78,7 +84,7 @@ class PackedMemoryArray {
     bool is_too_full() const;
     // Is the 'level' level out of balance with n_elems elems?
     bool is_out_of_balance(int n_elems, int level) const;
-    // Expand (double up) the current PMA and insert element e
+    // Expand (grow by Density::growth) the current PMA and insert element e
     void expand_PMA(E e);
     // Rebalance from the index 'index' at level 'level'
     void rebalance(int index, int level);
@@ -86,63 +92,74 @@ class PackedMemoryArray {
     void rebalance(int index, int level, E e);
     // Return the threshold at 'level'
     double upper_threshold_at(int level) const;
+    // Set segment_size, l and the limits for the current store size
+    void set_geometry();
     // Find the smallest interval encompassing index 'index' which is not out of balance
     int smallest_interval_in_balance(int index, int * node_index, int * node_level) const;
 };
 
-template <class E>
-double PackedMemoryArray<E>::upper_threshold_at(int level) const {
+template <class E, class Density, class Geometry>
+double PackedMemoryArray<E, Density, Geometry>::upper_threshold_at(int level) const {
 #ifndef OPTIMIZE
     assert(level <= l);
 #endif
-    return t_0 - ((t_0 - t_l) * 1.0 * level) / l; 
+    return Density::upper(level, l);
 }
 
-template <class E>
-bool PackedMemoryArray<E>::elem_exists_at(int index) const {
+template <class E, class Density, class Geometry>
+void PackedMemoryArray<E, Density, Geometry>::set_geometry() {
+    segment_size = Geometry::template chunk_size<E>(store.size());
+    // One liner log2 since both are powers of 2 :-P
+    l = __builtin_popcount(store.size()-1) - __builtin_popcount(segment_size-1);
+    // The thresholds go from level 0 to level l
+    limits.template init<Density>(segment_size, l);
+}
+
+template <class E, class Density, class Geometry>
+bool PackedMemoryArray<E, Density, Geometry>::elem_exists_at(int index) const {
 #ifndef OPTIMIZE
-    assert(index < (sizeof(int)*exists.size()));
+    assert(index < exists.size());
 #endif
     return (exists[index]);
 }
 
-template <class E>
-bool PackedMemoryArray<E>::is_too_full() const {
+template <class E, class Density, class Geometry>
+bool PackedMemoryArray<E, Density, Geometry>::is_too_full() const {
     // TODO Will change when we get lower thresholds
     return is_out_of_balance(s, l);
 }
 
-template <class E>
-bool PackedMemoryArray<E>::is_out_of_balance(int n_elems, int level) const {
+template <class E, class Density, class Geometry>
+bool PackedMemoryArray<E, Density, Geometry>::is_out_of_balance(int n_elems, int level) const {
    // TODO Will change when we get lower thresholds
-   return ((int)floor(upper_threshold_at(level) * CAPACITY_AT(level)) < n_elems);
+   return limits.max[level] < n_elems;
 }
 
-template <class E>
-E PackedMemoryArray<E>::elem_at(int index) const {
+template <class E, class Density, class Geometry>
+E PackedMemoryArray<E, Density, Geometry>::elem_at(int index) const {
 #ifndef OPTIMIZE
     assert(ELEM_EXISTS_AT(index));
 #endif
     return store[index];
 }
 
-template <class E>
-uint32 PackedMemoryArray<E>::size() const {
+template <class E, class Density, class Geometry>
+uint32 PackedMemoryArray<E, Density, Geometry>::size() const {
     return s;
 }
 
-template <class E>
-uint32 PackedMemoryArray<E>::store_size() const {
+template <class E, class Density, class Geometry>
+uint32 PackedMemoryArray<E, Density, Geometry>::store_size() const {
     return (uint32)(store.size());
 }
 
-template <class E>
-uint32 PackedMemoryArray<E>::capacity_at(int level) const {
+template <class E, class Density, class Geometry>
+uint32 PackedMemoryArray<E, Density, Geometry>::capacity_at(int level) const {
     return segment_size << level;
 }
 
-template <class E>
-PackedMemoryArray<E>::PackedMemoryArray(E e) : t_0(VAL_T_0), t_l(VAL_T_L), c(VAL_C) {
+template <class E, class Density, class Geometry>
+PackedMemoryArray<E, Density, Geometry>::PackedMemoryArray(E e) : c(Density::growth) {
     // Assert that c is a power of 2 and > 1
 #ifndef OPTIMIZE
     assert(c > 1 && !(c & (c-1)));
@@ -153,18 +170,7 @@ PackedMemoryArray<E>::PackedMemoryArray(E e) : t_0(VAL_T_0), t_l(VAL_T_L), c(VAL
     // Resize the bitmask as well
     exists.resize((size_t)ceil(c));
     insert_element_at(e, 0);
-    
-    // One liner log2 since c is a power of 2 :-P
-    int log2n = __builtin_popcount(store.size()-1);
-    if(log2n & (log2n-1)) {
-        // log2n is not a power of 2, round it up to the nearest power of 2.
-        segment_size = (int)floor(log2(1<<(log2n+1)));
-    }
-    else {
-        // log2n is a power of 2, so, all is fine.
-        segment_size = log2n;
-    }
-    l = log2n - log2(segment_size);
+    set_geometry();
 
     // Now assert that the upper thresholds are sane, and you do not go out of balance the very first time.
 #ifndef OPTIMIZE
@@ -173,12 +179,40 @@ PackedMemoryArray<E>::PackedMemoryArray(E e) : t_0(VAL_T_0), t_l(VAL_T_L), c(VAL
     // And we have set this thing in motion. Pray!
 }
 
-template <class E>
-PackedMemoryArray<E>::~PackedMemoryArray() {
+template <class E, class Density, class Geometry>
+PackedMemoryArray<E, Density, Geometry>::PackedMemoryArray(std::vector<E> v) : c(Density::growth) {
+    // Bulk load: sort the elements (if needed), put them at the start
+    // of a store of c times the next power of 2, and spread them out
+    // with a single rebalance of the root. This is O(n) for sorted
+    // input. An empty 'v' gives an empty store of c slots, the size
+    // PackedMemoryArray(E) starts from.
+    bool sorted = true;
+    for(int i = 1; i < (int)v.size() && sorted; i++)
+        sorted = !(v[i] < v[i-1]);
+    if(!sorted)
+        std::sort(v.begin(), v.end());
+
+    int n = 1;
+    while(n < (int)v.size())
+        n <<= 1;
+    s = 0;
+    store.resize(c*n);
+    exists.resize(c*n);
+    for(int i = 0; i < (int)v.size(); i++)
+        insert_element_at(v[i], i);
+
+    set_geometry();
+
+    if(s > 0)
+        rebalance(0, l);
+}
+
+template <class E, class Density, class Geometry>
+PackedMemoryArray<E, Density, Geometry>::~PackedMemoryArray() {
 }
 
-template <class E>
-void PackedMemoryArray<E>::print() const {
+template <class E, class Density, class Geometry>
+void PackedMemoryArray<E, Density, Geometry>::print() const {
     int empty = 0;
     for (int i = 0; i < store_size(); i++) {
         if(!ELEM_EXISTS_AT(i)) 
@@ -190,8 +224,8 @@ void PackedMemoryArray<E>::print() const {
     std::cerr << empty << "/" << store.size() << std::endl;
 }
 
-template <class E>
-inline void PackedMemoryArray<E>::insert_element_at(E e, int index) {
+template <class E, class Density, class Geometry>
+inline void PackedMemoryArray<E, Density, Geometry>::insert_element_at(E e, int index) {
     // There is no element at index 'index'
 #ifndef OPTIMIZE
     assert(!ELEM_EXISTS_AT(index));
@@ -199,7 +233,7 @@ inline void PackedMemoryArray<E>::insert_element_at(E e, int index) {
     // Actually putting the element
     store[index] = e;
     // Marking the entry in the bitmask
-    exists[index] = 1;
+    exists.set(index);
     // The bitmask works fine
 #ifndef OPTIMIZE
     assert(ELEM_EXISTS_AT(index));
@@ -208,10 +242,10 @@ inline void PackedMemoryArray<E>::insert_element_at(E e, int index) {
     ++s;
 }
 
-template <class E>
-int PackedMemoryArray<E>::find(E e) const {
+template <class E, class Density, class Geometry>
+int PackedMemoryArray<E, Density, Geometry>::find(E e) const {
     // TODO Make this binary search
-    for(int i = 0; i < store.size(); i++) {
+    for(int i = 0; i < (int)store.size(); i++) {
         if(ELEM_EXISTS_AT(i)) {
             if(store[i] == e)
                 return i;
@@ -222,8 +256,8 @@ int PackedMemoryArray<E>::find(E e) const {
     return -1;
 }
 
-template <class E>
-void PackedMemoryArray<E>::insert_element_after(E e, E after, int pos) {
+template <class E, class Density, class Geometry>
+void PackedMemoryArray<E, Density, Geometry>::insert_element_after(E e, E after, int pos) {
     // Find where we can insert
     int loc;
     loc = pos;
@@ -249,18 +283,14 @@ void PackedMemoryArray<E>::insert_element_after(E e, E after, int pos) {
     }
 }
 
-template <class E>
-int PackedMemoryArray<E>::upper_bound_in_segment(E e, int v) {
-    int best = -1;
-    for(int i = v*segment_size; i < (v+1)*segment_size; i++)
-        if(ELEM_EXISTS_AT(i) && store[i] <= e) 
-            return best = i;
-    return best;
+template <class E, class Density, class Geometry>
+int PackedMemoryArray<E, Density, Geometry>::upper_bound_in_segment(E e, int v) {
+    return first_present_le(store.data(), exists, v*segment_size, (v+1)*segment_size, e, std::less<E>());
 }
 
-template <class E>
-int PackedMemoryArray<E>::upper_bound(E e) {
-    int l = 0, r = ((int)store.size())/segment_size, pos; 
+template <class E, class Density, class Geometry>
+int PackedMemoryArray<E, Density, Geometry>::upper_bound(E e) {
+    int l = 0, r = ((int)store.size())/segment_size - 1, pos;
     while(l != r) {
         int m = l + (r - l + 1)/2;
         pos = upper_bound_in_segment(e, m);
@@ -273,14 +303,15 @@ int PackedMemoryArray<E>::upper_bound(E e) {
     return pos;
 }
 
-template <class E>
-inline void PackedMemoryArray<E>::insert_element(E e) {
+template <class E, class Density, class Geometry>
+inline void PackedMemoryArray<E, Density, Geometry>::insert_element(E e) {
     int pos = upper_bound(e);
-    insert_element_after(e, store[pos], pos);
+    // pos is -1 if 'e' goes before every element (or there is none)
+    insert_element_after(e, pos < 0 ? e : store[pos], pos);
 }
 
-template <class E>
-int PackedMemoryArray<E>::smallest_interval_in_balance(int index, int * node_index, int * node_level) const {
+template <class E, class Density, class Geometry>
+int PackedMemoryArray<E, Density, Geometry>::smallest_interval_in_balance(int index, int * node_index, int * node_level) const {
     // If we are trying to insert at the end of the PMA
     if (index == (int)store.size()) {
         index = (int)store.size() - 1;
@@ -297,15 +328,11 @@ int PackedMemoryArray<E>::smallest_interval_in_balance(int index, int * node_ind
         int right = left + sz;
 
         // Count only the necessary parts
-        for(int i = left; i < start; i++)
-            if(ELEM_EXISTS_AT(i))
-                count++;
-        for(int i = end + 1; i <= right; i++)
-            if(ELEM_EXISTS_AT(i))
-                count++;
+        count += exists.count(left, start);
+        count += exists.count(end + 1, right);
         
         start = left;
-        end = right;
+        end = right - 1;
 
         ++level;
         bool is_balanced = !is_out_of_balance(count + 1, level);
@@ -329,13 +356,12 @@ int PackedMemoryArray<E>::smallest_interval_in_balance(int index, int * node_ind
     return 1;
 }
 
-template <class E>
-void PackedMemoryArray<E>::expand_PMA(E e) {
+template <class E, class Density, class Geometry>
+void PackedMemoryArray<E, Density, Geometry>::expand_PMA(E e) {
     // Create a new store
-    std::vector<E> new_store;
-    new_store.resize(store.size() * 2);
-    std::vector<bool> new_exists;
-    new_exists.resize((int)ceil(s+1));
+    std::vector<E, arena_allocator<E> > new_store;
+    new_store.resize(store.size() * Density::growth);
+    bitmap new_exists(new_store.size());
     
     int count = 0, i;
     // Insert all elements less than e
@@ -343,89 +369,103 @@ void PackedMemoryArray<E>::expand_PMA(E e) {
         if(ELEM_EXISTS_AT(i)) {
             if(store[i] > e)
                 break;
-            new_exists[count] = 1;
+            new_exists.set(count);
             new_store[count++] = store[i];
         }
     
     // Insert the element we wanted
-    new_exists[count] = 1;
+    new_exists.set(count);
     new_store[count++] = e;
     
     // Insert rest of the elements
     for(; i < (int)store.size(); i++) 
         if(ELEM_EXISTS_AT(i)) {
-            new_exists[count] = 1;
+            new_exists.set(count);
             new_store[count++] = store[i];
         }
 
-    // Replace the existing store and bitmask
-    store = new_store;
-    exists = new_exists;
+    // Replace the existing store and bitmask (swapping, so the old
+    // store is freed instead of copied)
+    store.swap(new_store);
+    exists.swap(new_exists);
  
     // Increment the number of elements in the PMA
     s++;
     
     // std::cout << "Old smallest window size: " << segment_size << std::endl;
     // Recalculate l and segment_size
-    int log2n = __builtin_popcount(store.size()-1);
-    if(log2n & (log2n-1)) {
-        // log2n is not a power of 2, round it up to the nearest power of 2.
-        segment_size = 1<<((int)floor(log2(log2n<<1)));
-    }
-    else {
-        // log2n is a power of 2, so, all is fine.
-        segment_size = 1<<log2n;
-    }
-    l = log2n - log2(segment_size);
+    set_geometry();
     // std::cout << "New smallest window size: " << segment_size << std::endl;
 
     // Now rebalance the entire PMA 
     rebalance(0, l);
 }
 
-template<class E>
-void PackedMemoryArray<E>::rebalance(int index, int level, E e) {
+template <class E, class Density, class Geometry>
+void PackedMemoryArray<E, Density, Geometry>::rebalance(int index, int level, E e) {
 #ifndef OPTIMZE
     assert(level <= l);
 #endif
+    // insert_element_at() counts every element we move, so remember
+    // the size.
+    uint32 n = s;
     int c = CAPACITY_AT(level);
-    // Move all the elements to one side
-    int last = index + c - 1, count = 0;
-    bool element_inserted = false;
-    std::vector<E> level_copy;
+    // Move all the elements to one side, counting the ones that
+    // go after 'e'
+    int last = index + c - 1, count = 0, after = -1;
     for(int i = last; i >= index; i--) {
         if(ELEM_EXISTS_AT(i)) {
-            if(!element_inserted && store[i] < e) {
-                level_copy.push_back(e);
-                element_inserted = true;
+            if(after == -1 && store[i] < e)
+                after = count;
+            if(i != last) {
+                insert_element_at(store[i], last);
+                #ifndef OPTIMIZE
+                    delete_element_at(i);
+                #else
+                    exists.reset(i);
+                #endif
             }
-            level_copy.push_back(store[i]);
-            delete_element_at(i);
             --last;
             count++;
         }
     }
-
-    if(!element_inserted)
-        level_copy.push_back(e);
-
-    // Now copy
-    double k = (c*1.0)/(level_copy.size()), p = 0;
-    int correct_index;
-    for(int i = level_copy.size()-1; i >= 0; i--) {
+    // 'e' is the r'th element of the window
+    int r = after == -1 ? 0 : count - after;
+
+    // Now copy, putting 'e' in its place on the way. Every element
+    // moves left (or stays), so none is overwritten before it has
+    // moved.
+    double k = (c*1.0)/(count+1), p = 0;
+    int actual_index, correct_index;
+    for(int i = 0; i <= count; i++) {
         p += k;
         // Now insert the element at the right position
         correct_index = index + (int)p - 1;
-        insert_element_at(level_copy[i], correct_index);
+        if(i == r) {
+            insert_element_at(e, correct_index);
+            continue;
+        }
+        actual_index = last + 1 + i - (i > r);
+        if(correct_index == actual_index)
+            continue;
+        insert_element_at(store[actual_index], correct_index);
+        // Remove the left most copy
+#ifndef OPTIMIZE
+        delete_element_at(actual_index);
+#else
+        exists.reset(actual_index);
+#endif
     } 
+    s = n + 1;
 }
 
 
-template<class E>
-void PackedMemoryArray<E>::rebalance(int index, int level) {
+template <class E, class Density, class Geometry>
+void PackedMemoryArray<E, Density, Geometry>::rebalance(int index, int level) {
 #ifndef OPTIMIZE 
     assert(level <= l);
 #endif
+    uint32 n = s;
     int c = CAPACITY_AT(level);
     // Move all the elements to one side
     int last = index + c - 1, count = 0;
@@ -438,7 +478,7 @@ void PackedMemoryArray<E>::rebalance(int index, int level) {
                 #ifndef OPTIMIZE
                     delete_element_at(i);
                 #else
-                    exists[i] = 0;
+                    exists.reset(i);
                 #endif
                // Update the leftmost pointer, and count of elements moved
             }
@@ -463,22 +503,54 @@ void PackedMemoryArray<E>::rebalance(int index, int level) {
 #ifndef OPTIMIZE
         delete_element_at(actual_index);
 #else
-        exists[actual_index] = 0;
+        exists.reset(actual_index);
 #endif
     } 
+    s = n;
 }
 
-template <class E>
-void PackedMemoryArray<E>::delete_element_at(int index) {
+template <class E, class Density, class Geometry>
+void PackedMemoryArray<E, Density, Geometry>::delete_element_at(int index) {
 #ifndef OPTIMIZE
     assert(ELEM_EXISTS_AT(index));
 #endif
     // Just mark it non existent
-    exists[index] = 0;
+    exists.reset(index);
 }
 
-int main() {
-    
+int main(int argc, char **argv) {
+    const char *mode = argc > 1 ? argv[1] : "head";
+
+    if (!strcmp(mode, "bulk")) {
+        // Bulk-load 'n' random keys, check that the store holds all of
+        // them in order, then insert into a PMA loaded from nothing.
+        int n = argc > 2 ? atoi(argv[2]) : 10000000;
+        std::vector<int> v(n);
+        srand(0);
+        for(int i = 0; i < n; i++)
+            v[i] = rand();
+        Timer t;
+        t.start();
+        PackedMemoryArray<int> pma(v);
+        double time_taken = t.stop();
+        std::cout << "Bulk load: " << time_taken/1000000.0 << " seconds" << std::endl;
+
+        std::sort(v.begin(), v.end());
+        assert(pma.size() == (uint32)n);
+        int k = 0;
+        for(int i = 0; i < (int)pma.store_size(); i++)
+            if(pma.elem_exists_at(i))
+                assert(pma.elem_at(i) == v[k++]);
+        assert(k == n);
+
+        PackedMemoryArray<int> empty((std::vector<int>()));
+        assert(empty.size() == 0);
+        empty.insert_element(5);
+        empty.insert_element(3);
+        assert(empty.size() == 2 && empty.find(5) != -1);
+        return 0;
+    }
+
     PackedMemoryArray<int> pma(2);
     
     Timer t;
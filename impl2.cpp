@@ -1,390 +1,18 @@
-#include <iostream>
-#include <algorithm>
-#include <vector>
-#include <stdio.h>
-#include <stdlib.h>
-#include <assert.h>
-
-using namespace std;
-
-// #define dprintf(args...) printf(args)
-#define dprintf(args...)
-
-typedef vector<int> vi_t;
-
-int log2(int n) {
-    int lg2 = 0;
-    while (n > 1) {
-        n /= 2;
-        ++lg2;
-    }
-    return lg2;
-}
-
-long long nmoves = 0;
-
-struct PMA {
-    vi_t impl;
-    int nelems;
-    vector<bool> present;
-    int chunk_size;
-    int nchunks;
-    int nlevels;
-    int lgn;
-    vi_t tmp;
-
-    struct PMAIterator {
-        PMA *pma;
-        int i;
-
-        PMAIterator(PMA *p, int _i)
-            : pma(p), i(_i)
-        { }
-
-        PMAIterator(const PMAIterator &rhs) {
-            this->pma = rhs.pma;
-            this->i   = rhs.i;
-        }
-
-        PMAIterator&
-        operator=(PMAIterator &rhs) {
-            this->pma = rhs.pma;
-            this->i   = rhs.i;
-            return *this;
-        }
-
-        PMAIterator&
-        operator++() {
-            if (i < (int)pma->impl.size()) ++i;
-            while (i < (int)pma->impl.size() && !pma->present[i]) {
-                ++i;
-            }
-            return *this;
-        }
-
-        PMAIterator
-        operator++(int) {
-            PMAIterator tmp = *this;
-            ++(*this);
-            return tmp;
-        }
-
-        bool
-        operator==(PMAIterator rhs) {
-            return this->pma == rhs.pma && this->i == rhs.i;
-        }
-
-        bool
-        operator!=(PMAIterator rhs) {
-            return !(*this == rhs);
-        }
-
-        int&
-        operator*() {
-            assert(pma->present[this->i]);
-            return pma->impl[this->i];
-        }
-
-        int*
-        operator->() {
-            assert(pma->present[this->i]);
-            return &(pma->impl[this->i]);
-        }
-    };
-
-    typedef PMAIterator iterator;
-
-    PMA(int capacity = 2)
-        : nelems(0) {
-        assert(capacity > 1);
-        assert(1 << log2(capacity) == capacity);
-
-        this->init_vars(capacity);
-        this->impl.resize(capacity);
-        this->present.resize(capacity);
-    }
-
-
-    double
-    upper_threshold_at(int level) const {
-        assert(level <= this->nlevels);
-        double threshold = 1.0 - ((1.0 - 0.5) * level) / (double)this->lgn;
-        return threshold;
-    }
-
-    void
-    init_vars(int capacity) {
-        this->chunk_size = 1 << log2(log2(capacity) * 2);
-        assert(this->chunk_size == (1 << log2(this->chunk_size)));
-        this->nchunks = capacity / this->chunk_size;
-        this->nlevels = log2(this->nchunks);
-        this->lgn = log2(capacity);
-        dprintf("init_vars::capacity: %d, nelems: %d, chunk_size: %d, nchunks: %d\n", capacity, nelems, chunk_size, nchunks);
-    }
-
-    int
-    left_interval_boundary(int i, int interval_size) {
-        assert(interval_size == (1 << log2(interval_size)));
-        assert(i < (int)this->impl.size());
-
-        int q = i / interval_size;
-        int boundary = q * interval_size;
-        dprintf("left_interval_boundary(%d, %d) = %d\n", i, interval_size, boundary);
-        return boundary;
-    }
-
-    void
-    resize(int capacity) {
-        assert(capacity > this->impl.size());
-        assert(1 << log2(capacity) == capacity);
-
-        vi_t tmpi(capacity);
-        vector<bool> tmpp(capacity);
-        double d = (double)capacity / this->nelems;
-        int ctr = 0;
-        for (int i = 0; i < (int)this->impl.size(); ++i) {
-            if (this->present[i]) {
-                int idx = d*(ctr++);
-                tmpp[idx] = true;
-                tmpi[idx] = this->impl[i];
-            }
-        }
-        this->impl.swap(tmpi);
-        this->present.swap(tmpp);
-        this->init_vars(capacity);
-        nmoves += this->impl.size();
-        // dprintf("After resize: ");
-        // this->print();
-    }
-
-    void
-    get_interval_stats(int left, int level, bool &in_limit, int &sz) {
-        double t = upper_threshold_at(level);
-        int w = (1 << level) * this->chunk_size;
-        sz = 0;
-        for (int i = left; i < left + w; ++i) {
-            sz += this->present[i] ? 1 : 0;
-        }
-        double q = (double)(sz+1) / double(w);
-        dprintf("q: %f, t: %f\n", q, t);
-        in_limit = q < t;
-    }
-
-    int
-    lb_in_chunk(int l, int v) {
-        int i;
-        for (i = l; i < l + chunk_size; ++i) {
-            if (this->present[i]) {
-                if (this->impl[i] >= v) {
-                    return i;
-                }
-            }
-        }
-        return i;
-    }
-
-    int
-    lower_bound(int v) {
-        int i;
-        if (this->nelems == 0) {
-            i = this->impl.size();
-        } else {
-#if 0
-            for (i = 0; i < this->impl.size(); ++i) {
-                if (this->present[i] && !(this->impl[i] < v)) {
-                    break;
-                }
-            }
-#else
-            int l = 0, r = this->nchunks;
-            int m;
-            while (l != r) {
-                m = l + (r-l)/2;
-                int sz;
-                int left = left_interval_boundary(m * chunk_size, chunk_size);
-                int pos = lb_in_chunk(left, v);
-
-                // Why does this work? We assume that every chunk of
-                // size this->chunk_size contains at least 1
-                // element. Hence, if we reach the end of an interval
-                // without finding a lower bound, we conclude that all
-                // the elements in this chunk are < 'v'. Because every
-                // chunk contains at least 1 element, we will never
-                // reach the end of an interval because the interval
-                // is empty.
-                //
-                // Note: This is why we need lower density thresholds!
-                // 
-                if (pos == left + chunk_size) {
-                    // Move to right half
-                    l = m + 1;
-                } else {
-                    r = m;
-                }
-            }
-            i = l * chunk_size;
-#endif
-        }
-        dprintf("lower_bound(%d) == %d\n", v, i);
-        return i;
-    }
-
-    void
-    insert_merge(int l, int v) {
-        dprintf("insert_merge(%d, %d)\n", l, v);
-        // Insert by merging elements in a window of size 'chunk_size'
-        tmp.clear();
-        tmp.reserve(this->chunk_size);
-        for (int i = l; i < l + this->chunk_size; ++i) {
-            if (this->present[i]) {
-                this->present[i] = false;
-                tmp.push_back(this->impl[i]);
-            }
-        }
-        vi_t::iterator iter = std::lower_bound(tmp.begin(), tmp.end(), v);
-        tmp.insert(iter, v);
-
-        dprintf("insert_merge::tmp.size(): %d\n", tmp.size());
-        for (int i = 0; i < tmp.size(); ++i) {
-            this->present[l + i] = true;
-            this->impl[l + i] = tmp[i];
-        }
-        ++this->nelems;
-        nmoves += chunk_size;
-    }
-
-    void
-    rebalance_interval(int left, int level) {
-        dprintf("rebalance_interval(%d, %d)\n", left, level);
-        int w = (1 << level) * this->chunk_size;
-        tmp.clear();
-        tmp.reserve(w);
-        for (int i = left; i < left + w; ++i) {
-            if (this->present[i]) {
-                tmp.push_back(this->impl[i]);
-                this->present[i] = false;
-            }
-        }
-        double m = (double)(1<<level)*chunk_size / (double)tmp.size();
-        dprintf("m: %f, tmp.size(): %d\n", m, tmp.size());
-        assert(m >= 1.0);
-        for (int i = 0; i < tmp.size(); ++i) {
-            int k = i * m + left;
-            if (k >= left + w) {
-                dprintf("k: %d, left+w: %d\n", k, left + w);
-            }
-            assert(k < left + w);
-            this->present[k] = true;
-            this->impl[k] = tmp[i];
-        }
-        nmoves += w;
-    }
-
-    void
-    insert(int v) {
-        /*
-        if ((this->nelems + 2) * 2 > this->impl.size()) {
-            // resize array
-            this->resize(2 * this->impl.size());
-        }
-        */
-
-        int i = lower_bound(v);
-        if (i == this->impl.size()) {
-            --i;
-        }
-        assert(i > -1);
-        assert(i < this->impl.size());
-
-        // Check in a window of size 'w'
-        int w = chunk_size;
-        int level = 0;
-        int l = this->left_interval_boundary(i, w);
-
-        // Number of elements in current window. We just need sz to be
-        // less than w -- we don't need the exact value of 'sz' here.
-        int sz = w - 1;
-
-        bool in_limit = false;
-
-        // If the current chunk has space, then the last element will
-        // be unused (with significant probability). First check that
-        // as a quick check.
-        if (this->present[l + this->chunk_size - 1]) {
-            get_interval_stats(l, level, in_limit, sz);
-        }
-
-        if (sz < w) {
-            // There is some space in this interval. We can just
-            // shuffle elements and insert.
-            this->insert_merge(l, v);
-        } else {
-            // No space in this interval. Find an interval above this
-            // interval that is within limits, re-balance, and
-            // re-start insertion.
-            in_limit = false;
-            while (!in_limit) {
-                w *= 2;
-                level += 1;
-                // assert(level <= this->nlevels);
-                if (level > this->nlevels) {
-                    // Root node is out of balance. Resize array.
-                    this->resize(2 * this->impl.size());
-                    this->insert(v);
-                    return;
-                }
-
-                l = this->left_interval_boundary(i, w);
-                get_interval_stats(l, level, in_limit, sz);
-                dprintf("level: %d, this->nlevels: %d, in_limit: %d, sz: %d\n", level, this->nlevels, in_limit, sz);
-            }
-            this->rebalance_interval(l, level);
-            this->insert(v);
-        }
-
-    } // insert(int v)
-
-    int
-    size() const {
-        return this->nelems;
-    }
-
-    iterator
-    begin() {
-        return iterator(this, 0);
-    }
-
-    iterator
-    end() {
-        return iterator(this, this->impl.size());
-    }
-
-    void
-    print() {
-        for (int i = 0; i < (int)this->impl.size(); ++i) {
-            printf("%3d ", this->present[i] ? this->impl[i] : -1);
-        }
-        printf("\n");
-    }
-
-};
-
-template <typename Iter>
-bool
-is_sorted(Iter f, Iter l) {
-    Iter next = f;
-    while (f != l) {
-        ++next;
-        if (next != l && *f > *next) {
-            return false;
-        }
-        f = next;
-    }
-    return true;
-}
+#include "include/pma.hpp"
+#include "include/pma_map.hpp"
+#include "include/concurrent_pma.hpp"
+#include "include/mapped_pma.hpp"
+#include "include/persistent_pma.hpp"
+#include "include/compressed_pma.hpp"
+#include "include/timer.hpp"
+#include <string.h>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <sys/resource.h>
 
 void
-test_inserts(PMA &p1) {
+test_inserts(PMA<> &p1) {
     p1.insert(80);
     p1.print();
 
@@ -431,10 +59,145 @@ test_inserts(PMA &p1) {
     p1.print();
 }
 
+// Insert 'keys' one at a time into a PMA<Key>, then look each of them
+// up again.
+template <typename Key>
+void
+time_keys(const char *name, const vector<Key> &keys) {
+    Timer t;
+    PMA<Key> p;
+    t.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        p.insert(keys[i]);
+    }
+    double secs = t.stop() / 1000000.0;
+    printf("%-20s %d inserts: %lf seconds (%.0lf inserts/sec)\n",
+           name, p.size(), secs, keys.size() / secs);
+
+    long long found = 0;
+    t.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int j = p.lower_bound(keys[i]);
+        if (j < (int)p.impl.size()) {
+            j = p.lb_in_chunk(j, keys[i]);
+            found += j < (int)p.impl.size() && !(keys[i] < p.impl[j]);
+        }
+    }
+    secs = t.stop() / 1000000.0;
+    printf("%-20s %d lookups: %lf seconds (%.0lf ns/lookup)\n",
+           name, (int)keys.size(), secs, secs * 1e9 / keys.size());
+    assert(found == (long long)keys.size());
+}
+
+// Insert 'keys' into a PMA<int> whose arrays come from 'Alloc', then
+// look them up in random order: time, page faults and the AnonHugePages
+// the process ends up with.
+template <typename Alloc>
+void
+time_alloc(const char *name, const vi_t &keys) {
+    Timer t;
+    struct rusage r0, r1;
+    page_arena &a = page_arena::instance();
+    long mapped = a.nmapped, reused = a.nreused;
+    getrusage(RUSAGE_SELF, &r0);
+    PMA<int, std::less<int>, Alloc> p;
+    t.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        p.insert(keys[i]);
+    }
+    double ins = t.stop() / 1000000.0;
+    getrusage(RUSAGE_SELF, &r1);
+
+    long long found = 0;
+    t.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int k = keys[(i * 7919) % keys.size()];
+        int j = p.lower_bound_slot(k);
+        found += j < (int)p.impl.size() && p.impl[j] == k;
+    }
+    double look = t.stop() / 1000000.0;
+    assert(found == (long long)keys.size());
+
+    long huge = 0;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    while (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "AnonHugePages: %ld kB", &huge);
+    }
+    if (f) {
+        fclose(f);
+    }
+    printf("%-8s %.0lf ns/insert, %.0lf ns/lookup, %ld page faults, %ld MB in huge pages, "
+           "%ld arrays mapped, %ld reused\n", name, ins * 1e9 / keys.size(),
+           look * 1e9 / keys.size(), r1.ru_minflt - r0.ru_minflt, huge / 1024,
+           a.nmapped - mapped, a.nreused - reused);
+}
+
+// Insert 'keys' into a PMA<int>, uniform or adaptive: time and moves.
+void
+time_adaptive(const char *name, const vi_t &keys, bool adaptive) {
+    Timer t;
+    PMA<> p;
+    p.set_adaptive(adaptive);
+    nmoves = 0;
+    t.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        p.insert(keys[i]);
+    }
+    double secs = t.stop() / 1000000.0;
+    assert(p.size() == (int)keys.size());
+    printf("%-8s %-9s %lf seconds (%.0lf inserts/sec), %.1lf moves/insert\n", name,
+           adaptive ? "adaptive" : "uniform", secs, keys.size() / secs,
+           (double)nmoves / keys.size());
+}
+
+// Insert 'keys' into a PMA<int> with thresholds and growth from
+// 'Density' and chunks from 'Geometry', then look 'reads' keys up per
+// insert: time, moves and slots per key (at the end, and averaged over
+// the inserts, since the array only grows now and then), and the cost
+// of an operation in that mix.
+template <typename Density, typename Geometry>
+void
+time_policy(const char *name, const vi_t &keys, int reads) {
+    Timer t;
+    PMA<int, std::less<int>, arena_allocator<int>, no_values, Density, Geometry> p;
+    nmoves = 0;
+    double slots = 0;
+    int nsamples = 0;
+    t.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        p.insert(keys[i]);
+        if ((i & 1023) == 1023) {
+            slots += (double)p.impl.size() / (i + 1);
+            ++nsamples;
+        }
+    }
+    double ins = t.stop() * 1000.0 / keys.size();
+    p.finish_resize();
+
+    long long found = 0;
+    t.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int k = keys[(i * 7919) % keys.size()];
+        int j = p.lower_bound_slot(k);
+        found += j < (int)p.impl.size() && p.impl[j] == k;
+    }
+    double look = t.stop() * 1000.0 / keys.size();
+    assert(found == (long long)keys.size());
+    // Chunks of up to a page line up with the array (see byte_geometry)
+    int bytes = p.chunk_size * sizeof(int);
+    assert((uintptr_t)p.impl.data() % std::min(bytes, ARENA_PAGE) == 0);
+    printf("%-22s chunk %4d (%5d B), %.2lf slots/key (%.2lf avg), %5.1lf moves/insert, "
+           "%4.0lf ns/insert, %4.0lf ns/lookup, %4.0lf ns/op\n", name, p.chunk_size, bytes,
+           (double)p.impl.size() / p.size(), nsamples ? slots / nsamples : 0.0,
+           (double)nmoves / keys.size(), ins, look, (ins + reads * look) / (1 + reads));
+}
+
 int
-main() {
+main(int argc, char **argv) {
     dprintf("log2(%d) = %d\n", 6, log2(6));
-    PMA p1;
+    const char *mode = argc > 1 ? argv[1] : "hammer";
+    PMA<> p1;
     // PMA p2(4);
     // PMA p3(8);
     // PMA p10(1024);
@@ -446,12 +209,688 @@ main() {
     srand(0);
     vi_t v;
 #define NINSERTS 10000000
-    for (int i = 0; i < NINSERTS; ++i) {
-        // p1.insert(rand() % 65536);
-        p1.insert(NINSERTS - i);
-        // v.insert(v.begin(), 100000 - i);
+    int elems = argc > 2 ? atoi(argv[2]) : NINSERTS;
+    Timer t;
+
+    if (!strcmp(mode, "hammer")) {
+        for (int i = 0; i < elems; ++i) {
+            // p1.insert(rand() % 65536);
+            p1.insert(elems - i);
+            // v.insert(v.begin(), 100000 - i);
+        }
+        printf("%llu moves to insert %d elements\n", nmoves, p1.size());
+    } else if (!strcmp(mode, "batch")) {
+        // Sorted micro-batches of random keys: one insert per key
+        // vs. PMA::insert_batch().
+        int batchsz = argc > 3 ? atoi(argv[3]) : 1000;
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand();
+        }
+        for (int i = 0; i < elems; i += batchsz) {
+            std::sort(keys.begin() + i, keys.begin() + std::min(i + batchsz, elems));
+        }
+
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            p1.insert(keys[i]);
+        }
+        double secs = t.stop() / 1000000.0;
+        printf("insert:       %d elements in batches of %d: %lf seconds, %llu moves\n",
+               p1.size(), batchsz, secs, nmoves);
+
+        PMA<> p2;
+        nmoves = 0;
+        t.start();
+        for (int i = 0; i < elems; i += batchsz) {
+            p2.insert_batch(keys.begin() + i, keys.begin() + std::min(i + batchsz, elems));
+        }
+        secs = t.stop() / 1000000.0;
+        printf("insert_batch: %d elements in batches of %d: %lf seconds, %llu moves\n",
+               p2.size(), batchsz, secs, nmoves);
+    } else if (!strcmp(mode, "bulk")) {
+        // Bulk-load 'elems' sorted keys, like restoring a PMA from a
+        // dump.
+        for (int i = 0; i < elems; ++i) {
+            v.push_back(i * 2);
+        }
+        t.start();
+        PMA<> p2(v.begin(), v.end());
+        double secs = t.stop() / 1000000.0;
+        printf("Bulk-loaded %d elements in %lf seconds, %llu moves\n", p2.size(), secs, nmoves);
+    } else if (!strcmp(mode, "lookup")) {
+        // Random point lookups in a bulk-loaded PMA of 'elems' keys:
+        // PMA::lower_bound() (chunk index) vs. a binary search that
+        // probes the chunks themselves, each followed by
+        // PMA::lb_in_chunk() (build with -DCHUNK_SEARCH_SCALAR to
+        // time its scalar kernel). Then the index again, in gap-free
+        // mode.
+        int nlookups = argc > 3 ? atoi(argv[3]) : 1000000;
+        for (int i = 0; i < elems; ++i) {
+            v.push_back(i * 2);
+        }
+        PMA<> p2(v.begin(), v.end());
+        vi_t keys(nlookups);
+        for (int i = 0; i < nlookups; ++i) {
+            keys[i] = rand() % (2 * elems);
+        }
+
+        long long sum = 0;
+        t.start();
+        for (int i = 0; i < nlookups; ++i) {
+            int j = p2.lower_bound(keys[i]);
+            if (j < (int)p2.impl.size()) {
+                sum += p2.lb_in_chunk(j, keys[i]);
+            }
+        }
+        double secs = t.stop() / 1000000.0;
+        printf("index:  %d lookups in %d elements: %lf seconds (%.0lf ns/lookup)\n",
+               nlookups, p2.size(), secs, secs * 1e9 / nlookups);
+
+        long long sum2 = 0;
+        t.start();
+        for (int i = 0; i < nlookups; ++i) {
+            int x = keys[i];
+            int c = p2.search_chunks(p2.nchunks, [&](int m) {
+                    return p2.probe_chunk(m, x);
+                });
+            if (c < p2.nchunks) {
+                sum2 += p2.lb_in_chunk(c * p2.chunk_size, x);
+            }
+        }
+        secs = t.stop() / 1000000.0;
+        printf("chunks: %d lookups in %d elements: %lf seconds (%.0lf ns/lookup)\n",
+               nlookups, p2.size(), secs, secs * 1e9 / nlookups);
+        assert(sum == sum2);
+
+        p2.set_gap_free(true);
+        sum2 = 0;
+        t.start();
+        for (int i = 0; i < nlookups; ++i) {
+            int j = p2.lower_bound(keys[i]);
+            if (j < (int)p2.impl.size()) {
+                sum2 += p2.lb_in_chunk(j, keys[i]);
+            }
+        }
+        secs = t.stop() / 1000000.0;
+        printf("gapfree: %d lookups in %d elements: %lf seconds (%.0lf ns/lookup)\n",
+               nlookups, p2.size(), secs, secs * 1e9 / nlookups);
+        assert(sum == sum2);
+    } else if (!strcmp(mode, "types")) {
+        // The same random inserts and lookups with different key
+        // types: ints and 64-bit ids and doubles (SIMD kernels), and
+        // (tenant, timestamp) pairs (std::less on the pair).
+        vector<int> ints(elems);
+        vector<long long> ids(elems);
+        vector<double> doubles(elems);
+        vector<pair<int, long long> > pairs(elems);
+        for (int i = 0; i < elems; ++i) {
+            ints[i] = rand();
+            ids[i] = ((long long)rand() << 31) | rand();
+            doubles[i] = rand() / (double)RAND_MAX;
+            pairs[i] = make_pair(rand() % 1000, ids[i]);
+        }
+        time_keys("int", ints);
+        time_keys("long long", ids);
+        time_keys("double", doubles);
+        time_keys("pair<int,long long>", pairs);
+    } else if (!strcmp(mode, "map")) {
+        // Random point lookups of the keys of a PMAMap<int, int>
+        // against the same keys in a key-only PMA and in a std::map.
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand();
+        }
+        PMAMap<int, int> m;
+        std::map<int, int> sm;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            m.insert_or_assign(keys[i], i);
+        }
+        double secs = t.stop() / 1000000.0;
+        printf("PMAMap:   %d inserts: %lf seconds\n", m.size(), secs);
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            sm[keys[i]] = i;
+        }
+        secs = t.stop() / 1000000.0;
+        printf("std::map: %d inserts: %lf seconds\n", (int)sm.size(), secs);
+        // The same keys in the same order, without values
+        PMA<> p2;
+        for (int i = 0; i < elems; ++i) {
+            p2.insert(keys[i]);
+        }
+        for (int i = elems - 1; i > 0; --i) {
+            std::swap(keys[i], keys[rand() % (i + 1)]);
+        }
+
+        long long sum = 0;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            int j = p2.lower_bound(keys[i]);
+            sum += p2.lb_in_chunk(j, keys[i]) < j + p2.chunk_size;
+        }
+        secs = t.stop() / 1000000.0;
+        printf("PMA:      %d lookups: %lf seconds (%.0lf ns/lookup)\n",
+               elems, secs, secs * 1e9 / elems);
+        assert(sum == elems);
+
+        sum = 0;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            sum += m.find_slot(keys[i]) >= 0;
+        }
+        secs = t.stop() / 1000000.0;
+        printf("PMAMap:   %d find_slots: %lf seconds (%.0lf ns/lookup)\n",
+               elems, secs, secs * 1e9 / elems);
+        assert(sum == elems);
+
+        sum = 0;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            sum += *m.find(keys[i]);
+        }
+        secs = t.stop() / 1000000.0;
+        printf("PMAMap:   %d finds: %lf seconds (%.0lf ns/find)\n",
+               elems, secs, secs * 1e9 / elems);
+
+        long long sum2 = 0;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            sum2 += sm.find(keys[i])->second;
+        }
+        secs = t.stop() / 1000000.0;
+        printf("std::map: %d finds: %lf seconds (%.0lf ns/find)\n",
+               elems, secs, secs * 1e9 / elems);
+        assert(sum == sum2);
+    } else if (!strcmp(mode, "scan")) {
+        // Sum every element of a PMA of 'elems' random keys: slot by
+        // slot, with the iterator over range(), with
+        // for_each_in_range(), and over a plain sorted array of the
+        // same keys (the memory bandwidth bound).
+        int nscans = argc > 3 ? atoi(argv[3]) : 10;
+        for (int i = 0; i < elems; ++i) {
+            v.push_back(rand() % INT_MAX);
+            p1.insert(v.back());
+        }
+        std::sort(v.begin(), v.end());
+        printf("%d elements in %d slots\n", p1.size(), (int)p1.impl.size());
+        p1.finish_resize();
+
+        long long sums[4] = { 0, 0, 0, 0 };
+        const char *names[4] = { "slots", "range", "for_each", "array" };
+        for (int k = 0; k < 4; ++k) {
+            t.start();
+            for (int r = 0; r < nscans; ++r) {
+                long long sum = 0;
+                if (k == 0) {
+                    for (int i = 0; i < (int)p1.impl.size(); ++i) {
+                        if (p1.present[i]) {
+                            sum += p1.impl[i];
+                        }
+                    }
+                } else if (k == 1) {
+                    PMA<>::PMARange rg = p1.range(0, INT_MAX);
+                    for (PMA<>::iterator it = rg.begin(); it != rg.end(); ++it) {
+                        sum += *it;
+                    }
+                } else if (k == 2) {
+                    p1.for_each_in_range(0, INT_MAX, [&](int x) { sum += x; });
+                } else {
+                    for (int i = 0; i < elems; ++i) {
+                        sum += v[i];
+                    }
+                }
+                sums[k] += sum;
+            }
+            double secs = t.stop() / 1000000.0;
+            printf("%-8s: %.2lf ns/element, %.2lf GB/s of elements\n", names[k],
+                   secs * 1e9 / nscans / elems, nscans * (double)elems * sizeof(int) / secs / 1e9);
+        }
+        assert(sums[0] == sums[1] && sums[1] == sums[2] && sums[2] == sums[3]);
+    } else if (!strcmp(mode, "agg")) {
+        // count/sum/min-max/filter over the middle half of the keys of
+        // a PMA of 'elems' random inserts (at most about 50% full, as
+        // the root threshold allows; 30% at 10^7), then of 'elems'
+        // bulk-loaded keys (at most 50% full): the iterator against
+        // PMA's range primitives.
+        for (int d = 0; d < 2; ++d) {
+            vi_t keys(elems);
+            for (int i = 0; i < elems; ++i) {
+                keys[i] = rand() % INT_MAX;
+            }
+            PMA<> p(keys.begin(), keys.begin() + (d == 0 ? 0 : elems));
+            for (int i = 0; d == 0 && i < elems; ++i) {
+                p.insert(keys[i]);
+            }
+            p.finish_resize();
+            printf("%s: %d elements, %.0lf%% full\n", d == 0 ? "inserted" : "bulk-loaded",
+                   p.size(), 100.0 * p.size() / p.impl.size());
+            int lo = INT_MAX / 4, hi = INT_MAX / 4 * 3;
+
+            long long cnt = 0, sum = 0, sel = 0;
+            int mn = INT_MAX, mx = INT_MIN;
+            vi_t out;
+            out.reserve(elems);
+            t.start();
+            for (int x : p.range(lo, hi)) {
+                ++cnt;
+                sum += x;
+                mn = std::min(mn, x);
+                mx = std::max(mx, x);
+                if (x % 4 == 0) {
+                    out.push_back(x);
+                }
+            }
+            sel = out.size();
+            double secs = t.stop() / 1000000.0;
+            printf("  iterator:      %.2lf ms for count+sum+min/max+filter\n", secs * 1000);
+            long long sum1 = 0;
+            t.start();
+            for (int x : p.range(lo, hi)) {
+                sum1 += x;
+            }
+            secs = t.stop() / 1000000.0;
+            printf("  iterator:      %.2lf ms for sum\n", secs * 1000);
+
+            t.start();
+            long long cnt2 = p.count_range(lo, hi);
+            double s1 = t.stop();
+            t.start();
+            long long sum2 = p.sum_range(lo, hi);
+            double s2 = t.stop();
+            int mn2, mx2;
+            t.start();
+            p.min_max_range(lo, hi, mn2, mx2);
+            double s3 = t.stop();
+            out.clear();
+            t.start();
+            long long sel2 = p.select_where(lo, hi, [](int x) { return x % 4 == 0; },
+                                            std::back_inserter(out));
+            double s4 = t.stop();
+            printf("  count_range:   %.3lf ms\n  sum_range:     %.2lf ms\n"
+                   "  min_max_range: %.2lf ms\n  select_where:  %.2lf ms\n"
+                   "  total:         %.2lf ms\n",
+                   s1 / 1000, s2 / 1000, s3 / 1000, s4 / 1000, (s1 + s2 + s3 + s4) / 1000);
+            assert(cnt == cnt2 && sum == sum1 && sum == sum2 && mn == mn2 && mx == mx2 && sel == sel2);
+        }
+    } else if (!strcmp(mode, "mt")) {
+        // 'elems' random inserts into a ConcurrentPMA split over 1, 2,
+        // 4, ... up to 'nthreads' threads, against the plain PMA.
+        int nthreads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand() % INT_MAX;
+        }
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            p1.insert(keys[i]);
+        }
+        double base = t.stop() / 1000000.0;
+        printf("PMA:              %.2lf s (%.2lf M inserts/s)\n", base, elems / base / 1e6);
+        for (int nt = 1; nt <= std::max(nthreads, 1); nt *= 2) {
+            ConcurrentPMA<> cp;
+            vector<std::thread> threads;
+            t.start();
+            for (int k = 0; k < nt; ++k) {
+                threads.push_back(std::thread([&, k]() {
+                    for (int i = k; i < elems; i += nt) {
+                        cp.insert(keys[i]);
+                    }
+                }));
+            }
+            for (int k = 0; k < nt; ++k) {
+                threads[k].join();
+            }
+            double secs = t.stop() / 1000000.0;
+            printf("ConcurrentPMA %2d: %.2lf s (%.2lf M inserts/s, %.2lfx)\n",
+                   nt, secs, elems / secs / 1e6, base / secs);
+            assert(cp.size() == elems && cp.sync().verify_counts());
+        }
+    } else if (!strcmp(mode, "par")) {
+        // 'elems' random inserts, then a resize, with the large
+        // rebalances and the resize spread by one thread and by
+        // 'nthreads'; both must build the same array.
+        int nthreads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand() % INT_MAX;
+        }
+        PMA<> p[2];
+        p[0].nthreads = 1;
+        p[1].nthreads = std::max(nthreads, 1);
+        for (int k = 0; k < 2; ++k) {
+            t.start();
+            for (int i = 0; i < elems; ++i) {
+                p[k].insert(keys[i]);
+            }
+            p[k].finish_resize();
+            double secs = t.stop() / 1000000.0;
+            t.start();
+            p[k].resize(2 * p[k].impl.size());
+            double rsecs = t.stop() / 1000000.0;
+            printf("%2d threads: %.2lf s for %d inserts, %.0lf ms to resize to %d slots\n",
+                   p[k].nthreads, secs, elems, rsecs * 1000, (int)p[k].impl.size());
+        }
+        assert(p[0].present.words == p[1].present.words);
+        for (int i = 0; i < (int)p[0].impl.size(); ++i) {
+            assert(!p[0].present[i] || p[0].impl[i] == p[1].impl[i]);
+        }
+    } else if (!strcmp(mode, "file")) {
+        // Restarting with 'elems' random keys: reading them back from a
+        // text dump (one per line) and bulk-loading them, against
+        // opening a file PMA::save() wrote and doing 10^4 lookups, and
+        // then promoting it for writes. Minor page faults count the
+        // pages each one touched.
+        const char *path = argc > 3 ? argv[3] : "impl2-file.pma";
+        std::string text = std::string(path) + ".txt";
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand() % INT_MAX;
+        }
+        PMA<> p(keys.begin(), keys.end());
+        FILE *f = fopen(text.c_str(), "w");
+        for (int i = 0; i < elems; ++i) {
+            fprintf(f, "%d\n", keys[i]);
+        }
+        fclose(f);
+        t.start();
+        bool saved = p.save(path);
+        printf("save:           %.0lf ms\n", t.stop() / 1000);
+        assert(saved);
+
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        long faults = ru.ru_minflt + ru.ru_majflt;
+        t.start();
+        f = fopen(text.c_str(), "r");
+        vi_t loaded;
+        int x;
+        while (fscanf(f, "%d", &x) == 1) {
+            loaded.push_back(x);
+        }
+        fclose(f);
+        PMA<> q(loaded.begin(), loaded.end());
+        double secs = t.stop() / 1000000.0;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("text reload:    %.0lf ms, %ld page faults\n", secs * 1000,
+               ru.ru_minflt + ru.ru_majflt - faults);
+        assert(q.size() == elems);
+
+        faults = ru.ru_minflt + ru.ru_majflt;
+        long long found = 0;
+        t.start();
+        MappedPMA<> m;
+        bool opened = m.open(path);
+        for (int i = 0; i < 10000; ++i) {
+            found += m.find(keys[rand() % elems]);
+        }
+        secs = t.stop() / 1000000.0;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("open + 10^4 lookups: %.2lf ms, %ld page faults (the file has %ld pages)\n",
+               secs * 1000, ru.ru_minflt + ru.ru_majflt - faults, (long)(m.len + 4095) / 4096);
+        assert(opened && found == 10000);
+
+        t.start();
+        m.insert(-1);
+        printf("promote + insert: %.0lf ms\n", t.stop() / 1000);
+        assert(m.size() == elems + 1);
+        remove(path);
+        remove(text.c_str());
+    } else if (!strcmp(mode, "persist")) {
+        // Inserting 'elems' keys into a PersistentPMA at 'path' with a
+        // checkpoint every 'every' inserts: the bytes the checkpoints
+        // write against the size of the file. Killed (say, with
+        // kill -9) and run again, it recovers and checks the keys it
+        // had inserted, and carries on from there.
+        const char *path = argc > 3 ? argv[3] : "impl2-persist.pma";
+        int every = argc > 4 ? atoi(argv[4]) : 100000;
+        auto key = [](int i) { return (int)((2654435761u * (unsigned)i) % INT_MAX); };
+        PersistentPMA<> pp;
+        t.start();
+        bool opened = pp.open(path);
+        int n = pp.size();
+        printf("open: %d keys in %.0lf ms\n", n, t.stop() / 1000);
+        assert(opened);
+        vi_t expected(n);
+        for (int i = 0; i < n; ++i) {
+            expected[i] = key(i);
+        }
+        std::sort(expected.begin(), expected.end());
+        assert(std::equal(expected.begin(), expected.end(), pp.pma.begin()));
+
+        long long bytes = 0;
+        int full = 0, incremental = 0;
+        double secs = 0;
+        for (int i = n; i < elems; ++i) {
+            bool logged = pp.insert(key(i));
+            assert(logged);
+            if ((i + 1) % every == 0 || i + 1 == elems) {
+                int64_t capacity = pp.h.capacity;
+                t.start();
+                bool ok = pp.checkpoint();
+                secs += t.stop() / 1000000.0;
+                assert(ok);
+                bytes += pp.checkpoint_bytes;
+                ++(capacity == pp.h.capacity ? incremental : full);
+            }
+        }
+        printf("%d checkpoints (%d full): %.0lf ms, %.1lf MB written, %.1lf MB/checkpoint; "
+               "the file is %.1lf MB\n", full + incremental, full, secs * 1000, bytes / 1e6,
+               bytes / 1e6 / std::max(1, full + incremental), pp.h.file_size / 1e6);
+        remove(path);
+        remove((std::string(path) + ".log").c_str());
+    } else if (!strcmp(mode, "compressed")) {
+        // 'elems' 64-bit ids about 'gap' apart, inserted in random
+        // order into a PMA and a CompressedPMA: time, bytes per key,
+        // lookups and a full scan.
+        int gap = argc > 3 ? atoi(argv[3]) : 4;
+        vector<int64_t> ids(elems);
+        for (int i = 0; i < elems; ++i) {
+            ids[i] = (1LL << 40) + (int64_t)i * gap + rand() % gap;
+        }
+        std::random_shuffle(ids.begin(), ids.end());
+        PMA<int64_t> p;
+        CompressedPMA<int64_t> cp;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            p.insert(ids[i]);
+        }
+        double pins = t.stop() / 1000000.0;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            cp.insert(ids[i]);
+        }
+        double cins = t.stop() / 1000000.0;
+        size_t pbytes = sizeof(int64_t) * (p.impl.size() + p.index.key.size() + 1) +
+            sizeof(uint64_t) * p.present.words.size() + sizeof(int) * p.counts.cnt.size();
+
+        long long pfound = 0, cfound = 0;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            int j = p.lower_bound_slot(ids[i]);
+            pfound += j < (int)p.impl.size() && p.impl[j] == ids[i];
+        }
+        double plook = t.stop() / 1000000.0;
+        t.start();
+        for (int i = 0; i < elems; ++i) {
+            cfound += cp.find(ids[i]);
+        }
+        double clook = t.stop() / 1000000.0;
+        assert(pfound == elems && cfound == elems);
+
+        int64_t psum = 0, csum = 0;
+        t.start();
+        p.for_each_in_range(INT64_MIN, INT64_MAX, [&](int64_t k) { psum += k; });
+        double pscan = t.stop() / 1000.0;
+        t.start();
+        cp.for_each([&](int64_t k) { csum += k; });
+        double cscan = t.stop() / 1000.0;
+        assert(psum == csum);
+        printf("%-15s %.2lf bytes/key, %.0lf ns/insert, %.0lf ns/lookup, scan %.1lf ms\n",
+               "PMA", (double)pbytes / elems, pins * 1e9 / elems, plook * 1e9 / elems, pscan);
+        printf("%-15s %.2lf bytes/key, %.0lf ns/insert, %.0lf ns/lookup, scan %.1lf ms "
+               "(%d words/chunk)\n", "CompressedPMA", (double)cp.bytes() / elems,
+               cins * 1e9 / elems, clook * 1e9 / elems, cscan, cp.chunk_words);
+    } else if (!strcmp(mode, "arena")) {
+        // 'elems' random inserts and lookups with the arrays in
+        // operator new memory (lazy_allocator) and in page_arena's
+        // huge-page-aligned mappings (arena_allocator, the default).
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand();
+        }
+        time_alloc<lazy_allocator<int> >("new", keys);
+        time_alloc<arena_allocator<int> >("arena", keys);
+    } else if (!strcmp(mode, "adaptive")) {
+        // 'elems' inserts with uniform and adaptive rebalancing:
+        // descending keys (hammer), random keys, and runs of 'burst'
+        // ascending keys that each start somewhere random.
+        int burst = argc > 3 ? atoi(argv[3]) : 1000;
+        vi_t hammer(elems), random(elems), bursts(elems);
+        for (int i = 0; i < elems; ++i) {
+            hammer[i] = elems - i;
+            random[i] = rand();
+        }
+        for (int i = 0; i < elems; i += burst) {
+            int base = rand() % (INT_MAX - burst);
+            for (int j = i; j < std::min(elems, i + burst); ++j) {
+                bursts[j] = base + j - i;
+            }
+        }
+        for (int a = 0; a < 2; ++a) {
+            time_adaptive("hammer", hammer, a);
+        }
+        for (int a = 0; a < 2; ++a) {
+            time_adaptive("random", random, a);
+        }
+        for (int a = 0; a < 2; ++a) {
+            time_adaptive("bursts", bursts, a);
+        }
+    } else if (!strcmp(mode, "policy")) {
+        // 'elems' random inserts and lookups under a few density and
+        // geometry policies, with the cost of an operation in a mix of
+        // 'reads' lookups per insert.
+        int reads = argc > 3 ? atoi(argv[3]) : 1;
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand();
+        }
+        time_policy<default_density, default_geometry>("default", keys, reads);
+        time_policy<density_policy<1000, 750, 125, 250>, default_geometry>(
+            "upper root 0.75", keys, reads);
+        time_policy<density_policy<1000, 400, 100, 200>, default_geometry>(
+            "upper root 0.4", keys, reads);
+        time_policy<density_policy<900, 600, 100, 300>, default_geometry>(
+            "upper leaf 0.9", keys, reads);
+        time_policy<density_policy<1000, 500, 62, 125, 4>, default_geometry>(
+            "growth 4", keys, reads);
+        time_policy<default_density, log_geometry<1> >("chunk log2(n)", keys, reads);
+        time_policy<default_density, log_geometry<4> >("chunk 4 log2(n)", keys, reads);
+        time_policy<default_density, log_geometry<8> >("chunk 8 log2(n)", keys, reads);
+    } else if (!strcmp(mode, "geometry")) {
+        // time_policy() with chunks derived from log2 of the capacity
+        // against chunks of a few cache lines and of a page.
+        int reads = argc > 3 ? atoi(argv[3]) : 1;
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand();
+        }
+        time_policy<default_density, log_geometry<1> >("log2(n)", keys, reads);
+        time_policy<default_density, default_geometry>("2 log2(n)", keys, reads);
+        time_policy<default_density, line_geometry<1> >("1 line", keys, reads);
+        time_policy<default_density, line_geometry<2> >("2 lines", keys, reads);
+        time_policy<default_density, line_geometry<4> >("4 lines", keys, reads);
+        time_policy<default_density, line_geometry<16> >("16 lines", keys, reads);
+        time_policy<default_density, page_geometry>("page", keys, reads);
+    } else if (!strcmp(mode, "mtread")) {
+        // Latency of random lookups into a ConcurrentPMA of 'elems'
+        // keys: with no writer, while a writer inserts another 'elems'
+        // keys (which resizes the array), and with the reader taking
+        // the resize barrier like an insert does.
+        vi_t keys(2 * elems);
+        for (int i = 0; i < 2 * elems; ++i) {
+            keys[i] = rand() % INT_MAX;
+        }
+        const char *names[] = { "no writer", "writer", "writer, locked" };
+        for (int k = 0; k < 3; ++k) {
+            ConcurrentPMA<> cp;
+            for (int i = 0; i < elems; ++i) {
+                cp.insert(keys[i]);
+            }
+            std::atomic<bool> done(k == 0);
+            std::thread writer([&]() {
+                for (int i = elems; k > 0 && i < 2 * elems; ++i) {
+                    cp.insert(keys[i]);
+                }
+                done = true;
+            });
+            vector<double> latency;
+            long long found = 0;
+            for (int i = 0; !done || (int)latency.size() < 1000000; ++i) {
+                int key = keys[rand() % elems];
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                if (k == 2) {
+                    std::shared_lock<std::shared_mutex> g(cp.barrier);
+                    found += cp.find(key);
+                } else {
+                    found += cp.find(key);
+                }
+                latency.push_back(std::chrono::duration<double, std::micro>(
+                                      std::chrono::steady_clock::now() - t0).count());
+            }
+            writer.join();
+            assert(found == (long long)latency.size());
+            int n = latency.size();
+            std::sort(latency.begin(), latency.end());
+            printf("%-15s %d lookups: p50 %.2lf us, p99.9 %.2lf us, max %.2lf ms\n",
+                   names[k], n, latency[n / 2], latency[n - n / 1000 - 1],
+                   latency[n - 1] / 1000.0);
+        }
+    } else if (!strcmp(mode, "mtswitch")) {
+        // Lock-free readers while a ConcurrentPMA fills up from empty,
+        // 'elems' keys at a time, 100 times over: every round switches
+        // from locked to lock-free reads (the first table is published)
+        // with 'nthreads' readers looking up the keys inserted so far.
+        int nthreads = argc > 3 ? atoi(argv[3]) : 4;
+        vi_t keys(elems);
+        for (int i = 0; i < elems; ++i) {
+            keys[i] = rand() % INT_MAX;
+        }
+        long long found = 0;
+        for (int round = 0; round < 100; ++round) {
+            ConcurrentPMA<> cp;
+            std::atomic<int> ninserted(0);
+            vector<std::thread> readers;
+            for (int k = 0; k < nthreads; ++k) {
+                readers.push_back(std::thread([&, k]() {
+                    unsigned seed = round * nthreads + k;
+                    long long n = 0;
+                    int m;
+                    while ((m = ninserted.load(std::memory_order_acquire)) < elems) {
+                        if (m > 0) {
+                            int key = keys[rand_r(&seed) % m];
+                            assert(cp.find(key));
+                            long long sum = 0;
+                            cp.for_each_in_range(key, INT_MAX, [&](int x) { sum += x; });
+                            assert(sum >= key);
+                            ++n;
+                        }
+                    }
+                    __atomic_fetch_add(&found, n, __ATOMIC_RELAXED);
+                }));
+            }
+            for (int i = 0; i < elems; ++i) {
+                cp.insert(keys[i]);
+                ninserted.store(i + 1, std::memory_order_release);
+            }
+            for (int k = 0; k < nthreads; ++k) {
+                readers[k].join();
+            }
+            assert(cp.size() == elems && cp.sync().verify_counts());
+        }
+        printf("%lld lookups and scans during 100 rounds of %d inserts\n", found, elems);
     }
-    printf("%llu moves to insert %d elements\n", nmoves, p1.size());
 
     // assert(is_sorted(p1.begin(), p1.end()));
 
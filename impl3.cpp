@@ -0,0 +1,458 @@
+#include "include/pma.hpp"
+#include "include/timer.hpp"
+#include <string.h>
+
+// Partially deamortized PMA (see doc/pdpma.tex).
+//
+// The imaginary tree over the chunks of 'pma' is split at
+// 'bottom_level'. A window at or below that level (a bottom tree) is
+// at most ~sqrt(n) slots wide and is rebalanced normally through
+// PMA::rebalance_interval(). A window above it (or a resize) is
+// rebuilt piece by piece: every insert performs at most 'step' slots
+// of the rebuild, and inserts that arrive while a rebuild is in
+// progress are parked in 'parking', a small sorted array. Once the
+// rebuild is done, the parking lot is drained a couple of elements
+// per insert.
+//
+// A rebuild has 2 phases. In SCATTER we copy the elements of the
+// window to their final (evenly spread) positions in 'shadow'. The
+// PMA itself is untouched, so lookups keep using it. In COPY_BACK we
+// copy 'shadow' back into the window a few chunks at a time, and
+// lookups for keys inside the window are answered from 'shadow'. A
+// resize only has the SCATTER phase, after which the arrays are
+// swapped.
+struct PDPMA {
+    enum { IDLE, SCATTER, COPY_BACK };
+
+    PMA<> pma;
+    // Elements inserted while a rebuild is in progress
+    vi_t parking;
+    int bottom_level;
+    int bottom_size;
+    // Number of slots of the rebuild processed per insert
+    int step;
+
+    // The rebuild in progress
+    int state;
+    bool resizing;
+    int rleft, rwidth;  // The window being rebuilt
+    int rsrc;           // Next slot of the window to scatter
+    int rdst;           // Next slot of 'shadow' to copy back
+    int rctr;           // Number of elements scattered so far
+    int rnelems;        // Number of elements in the window
+    int rlo, rhi;       // Smallest and largest element in the window
+    double rd;          // Distance between 2 spread elements
+    PMA<>::keys_t shadow;
+    bitmap shadow_present;
+    // Counts tree and chunk index of the array being built by the
+    // resize in progress. They are filled in a bottom tree at a time,
+    // as the scatter gets past each one.
+    counts_tree cnew;
+    chunk_index<int> inew;
+    int bnew_level;
+    int bnew_size;
+    int bnew_built;
+    int bnew_capacity;
+
+    PDPMA(int capacity = 2)
+        : pma(capacity), state(IDLE), resizing(false) {
+        this->init_bottom(capacity, this->pma.chunk_size, this->bottom_level, this->bottom_size);
+        this->step = 2 * this->bottom_size;
+    }
+
+    // Compute the height and the width of the bottom trees of a PMA
+    // with 'capacity' slots and chunks of 'chunk_size' slots.
+    static void
+    init_bottom(int capacity, int chunk_size, int &level, int &size) {
+        int nlevels = log2(capacity / chunk_size);
+        level = log2(capacity) / 2 - log2(chunk_size);
+        level = std::max(0, std::min(level, nlevels));
+        size = chunk_size << level;
+    }
+
+    int
+    size() const {
+        return this->pma.size() + (int)this->parking.size();
+    }
+
+    void
+    park(int v) {
+        vi_t::iterator iter = std::lower_bound(this->parking.begin(), this->parking.end(), v);
+        this->parking.insert(iter, v);
+    }
+
+    // Make 'shadow' ready to receive a window of 'w' slots. We never
+    // zero (or copy) 'w' slots here: 'shadow' only grows as the
+    // rebuild scatters elements into it.
+    void
+    init_shadow(int w) {
+        if ((int)this->shadow.capacity() < w) {
+            PMA<>::keys_t().swap(this->shadow);
+            bitmap().swap(this->shadow_present);
+            this->shadow.reserve(w);
+            this->shadow_present.reserve(w);
+        }
+        int n = std::min((int)this->shadow_present.size(), w);
+        this->shadow_present.clear(0, n);
+    }
+
+    void
+    grow_shadow(int n) {
+        if ((int)this->shadow.size() < n) {
+            this->shadow.resize(n);
+            this->shadow_present.resize(n);
+        }
+    }
+
+    void
+    start_rebuild(int left, int w, int nelems) {
+        dprintf("start_rebuild(%d, %d, %d)\n", left, w, nelems);
+        this->state = SCATTER;
+        this->resizing = false;
+        this->rleft = left;
+        this->rwidth = w;
+        this->rsrc = left;
+        this->rctr = 0;
+        this->rnelems = nelems;
+        this->rd = (double)w / nelems;
+        this->init_shadow(w);
+    }
+
+    void
+    start_resize() {
+        int capacity = 2 * this->pma.impl.size();
+        dprintf("start_resize(%d)\n", capacity);
+        this->state = SCATTER;
+        this->resizing = true;
+        this->rleft = 0;
+        this->rwidth = this->pma.impl.size();
+        this->rsrc = 0;
+        this->rctr = 0;
+        this->rnelems = this->pma.nelems;
+        this->rd = (double)capacity / this->pma.nelems;
+        PMA<>::keys_t().swap(this->shadow);
+        bitmap().swap(this->shadow_present);
+        this->init_shadow(capacity);
+
+        int chunk_size = PMA<>::chunk_size_for(capacity);
+        init_bottom(capacity, chunk_size, this->bnew_level, this->bnew_size);
+        this->cnew.init(capacity / chunk_size);
+        this->inew.init(capacity / chunk_size);
+        this->bnew_built = 0;
+        this->bnew_capacity = capacity;
+    }
+
+    // Count and index the bottom trees of the new array that lie
+    // entirely before slot 'end' of 'shadow'.
+    void
+    build_new_bottom_trees(int end) {
+        int chunk_size = PMA<>::chunk_size_for(this->bnew_capacity);
+        int nchunks = this->bnew_size / chunk_size;
+        for (; (this->bnew_built + 1) * this->bnew_size <= end; ++this->bnew_built) {
+            this->grow_shadow((this->bnew_built + 1) * this->bnew_size);
+            this->cnew.rebuild(this->shadow_present, chunk_size, this->bnew_level, this->bnew_built);
+
+            int c = this->bnew_built * nchunks;
+            int k = c > 0 ? this->inew.get(c - 1) : int();
+            for (; c < (this->bnew_built + 1) * nchunks; ++c) {
+                int i = this->shadow_present.prev(c * chunk_size, (c + 1) * chunk_size);
+                if (i >= 0) {
+                    k = this->shadow[i];
+                }
+                this->inew.set(c, k);
+            }
+        }
+    }
+
+    void
+    finish_resize() {
+        int capacity = this->bnew_capacity;
+        this->grow_shadow(capacity);
+        this->build_new_bottom_trees(capacity);
+        this->pma.impl.swap(this->shadow);
+        this->pma.present.swap(this->shadow_present);
+        this->pma.counts.swap(this->cnew);
+        this->pma.index.swap(this->inew);
+        this->pma.init_vars(capacity);
+        init_bottom(capacity, this->pma.chunk_size, this->bottom_level, this->bottom_size);
+        this->step = 2 * this->bottom_size;
+        this->state = IDLE;
+    }
+
+    // Perform at most 'step' slots worth of the rebuild in progress.
+    void
+    rebuild_step() {
+        if (this->state == SCATTER) {
+            int end = std::min(this->rsrc + this->step, this->rleft + this->rwidth);
+            nmoves += end - this->rsrc;
+            for (; this->rsrc < end; ++this->rsrc) {
+                if (!this->pma.present[this->rsrc]) {
+                    continue;
+                }
+                int v = this->pma.impl[this->rsrc];
+                int k = this->rd * (this->rctr++);
+                this->grow_shadow(k + 1);
+                this->shadow_present.set(k);
+                this->shadow[k] = v;
+                if (this->rctr == 1) {
+                    this->rlo = v;
+                }
+                this->rhi = v;
+            }
+            if (this->resizing) {
+                // Every element still to come goes at or after this.
+                this->build_new_bottom_trees(this->rd * this->rctr);
+            }
+            if (this->rsrc == this->rleft + this->rwidth) {
+                if (this->resizing) {
+                    this->finish_resize();
+                } else {
+                    this->grow_shadow(this->rwidth);
+                    this->state = COPY_BACK;
+                    this->rdst = 0;
+                }
+            }
+        } else if (this->state == COPY_BACK) {
+            // 'step' is a multiple of the bottom tree size, so a
+            // bottom tree is never half copied when an insert returns.
+            int begin = this->rdst;
+            int end = std::min(this->rdst + this->step, this->rwidth);
+            nmoves += end - this->rdst;
+            for (; this->rdst < end; ++this->rdst) {
+                int i = this->rleft + this->rdst;
+                this->pma.present.set(i, this->shadow_present[this->rdst]);
+                if (this->shadow_present[this->rdst]) {
+                    this->pma.impl[i] = this->shadow[this->rdst];
+                }
+            }
+            for (int b = (this->rleft + begin) / this->bottom_size;
+                 b < (this->rleft + end) / this->bottom_size; ++b) {
+                this->pma.counts.rebuild(this->pma.present, this->pma.chunk_size, this->bottom_level, b);
+            }
+            this->pma.refresh_index((this->rleft + begin) / this->pma.chunk_size,
+                                    (this->rleft + end) / this->pma.chunk_size);
+            if (this->rdst == this->rwidth) {
+                this->state = IDLE;
+            }
+        }
+    }
+
+    // Insert 'v' into the PMA if that does not need a rebalance of a
+    // top window. Otherwise, start rebuilding that window (or
+    // resizing the PMA) and return false.
+    bool
+    try_insert(int v) {
+        int i = this->pma.lower_bound(v);
+        if (i == (int)this->pma.impl.size()) {
+            --i;
+        }
+
+        int w = this->pma.chunk_size;
+        int level = 0;
+        int l = this->pma.left_interval_boundary(i, w);
+        int sz = w - 1;
+        bool in_limit = false;
+
+        if (this->pma.present[l + w - 1]) {
+            this->pma.get_interval_stats(l, level, in_limit, sz);
+        }
+        if (sz < w) {
+            this->pma.insert_merge(l, v);
+            return true;
+        }
+
+        in_limit = false;
+        while (!in_limit) {
+            w *= 2;
+            level += 1;
+            if (level > this->pma.nlevels) {
+                this->start_resize();
+                return false;
+            }
+            l = this->pma.left_interval_boundary(i, w);
+            this->pma.get_interval_stats(l, level, in_limit, sz);
+        }
+
+        if (level > this->bottom_level) {
+            this->start_rebuild(l, w, sz);
+            return false;
+        }
+        this->pma.rebalance_interval(l, level);
+        return this->try_insert(v);
+    }
+
+    void
+    insert(int v) {
+        if (this->state != IDLE) {
+            this->park(v);
+            this->rebuild_step();
+            return;
+        }
+        if (!this->try_insert(v)) {
+            this->park(v);
+            this->rebuild_step();
+            return;
+        }
+        // Drain the parking lot.
+        for (int k = 0; k < 2 && this->state == IDLE && !this->parking.empty(); ++k) {
+            if (!this->try_insert(this->parking.back())) {
+                // The element stays parked till the rebuild we just
+                // started is done.
+                this->rebuild_step();
+                break;
+            }
+            this->parking.pop_back();
+        }
+    }
+
+    // Find the smallest element >= 'v' in the PMA or the parking
+    // lot, and store it in 'res'. Returns false if there is no such
+    // element.
+    bool
+    lower_bound(int v, int &res) {
+        bool found = false;
+        if (this->state == COPY_BACK && v >= this->rlo && v <= this->rhi) {
+            // The window is half copied. Binary search over the
+            // elements in 'shadow', the k'th of which is at rd*k.
+            int l = 0, r = this->rnelems - 1;
+            while (l != r) {
+                int m = l + (r-l)/2;
+                if (this->shadow[(int)(this->rd * m)] < v) {
+                    l = m + 1;
+                } else {
+                    r = m;
+                }
+            }
+            res = this->shadow[(int)(this->rd * l)];
+            found = true;
+        } else {
+            // If a window is half copied, every element in it is
+            // either < v or >= v, so whichever of the 2 layouts a
+            // chunk in it has doesn't matter.
+            int i = this->pma.lower_bound(v);
+            if (i < (int)this->pma.impl.size()) {
+                int j = this->pma.lb_in_chunk(i, v);
+                if (j < i + this->pma.chunk_size) {
+                    res = this->pma.impl[j];
+                    found = true;
+                }
+            }
+        }
+
+        vi_t::iterator iter = std::lower_bound(this->parking.begin(), this->parking.end(), v);
+        if (iter != this->parking.end() && (!found || *iter < res)) {
+            res = *iter;
+            found = true;
+        }
+        return found;
+    }
+
+    bool
+    find(int v) {
+        int res;
+        return this->lower_bound(v, res) && res == v;
+    }
+
+    // Finish the rebuild in progress and empty the parking lot.
+    void
+    flush() {
+        while (true) {
+            while (this->state != IDLE) {
+                this->rebuild_step();
+            }
+            if (this->parking.empty()) {
+                return;
+            }
+            if (this->try_insert(this->parking.back())) {
+                this->parking.pop_back();
+            }
+        }
+    }
+
+    // Debug check of the PMA's counts and index (see
+    // PMA::verify_counts()) and of the parking lot's order. While a
+    // window is being copied back, its slots hold some elements twice
+    // and others not at all, so there must be no rebuild in progress.
+    bool
+    verify_counts() const {
+        assert(this->state == IDLE);
+        return this->pma.verify_counts() &&
+            std::is_sorted(this->parking.begin(), this->parking.end());
+    }
+
+};
+
+// Whether 'v' is in 'p'.
+bool
+contains(PMA<> &p, int v) {
+    int j = p.lower_bound_slot(v);
+    return j < (int)p.impl.size() && p.impl[j] == v;
+}
+
+bool
+contains(PDPMA &p, int v) {
+    return p.find(v);
+}
+
+// Finish any work left over from the inserts.
+void
+settle(PMA<> &p) {
+    p.finish_resize();
+}
+
+void
+settle(PDPMA &p) {
+    p.flush();
+}
+
+template <typename T>
+void
+benchmark(const char *name, const char *mode, int elems) {
+    T p;
+    Timer t, total;
+    vector<double> latency(elems);
+    vi_t keys(elems);
+    nmoves = 0;
+    srand(0);
+    for (int i = 0; i < elems; ++i) {
+        keys[i] = !strcmp(mode, "hammer") ? 20001000 - i : rand() % (1<<22);
+    }
+
+    total.start();
+    for (int i = 0; i < elems; ++i) {
+        t.start();
+        p.insert(keys[i]);
+        latency[i] = t.stop();
+    }
+    double secs = total.stop() / 1000000.0;
+
+    // Whatever is parked, being rebuilt or half resized must still be
+    // found, and must all be in place once that work is done.
+    assert(p.size() == elems);
+    for (int i = 0; i < elems; ++i) {
+        assert(contains(p, keys[i]));
+    }
+    settle(p);
+    assert(p.size() == elems && p.verify_counts());
+    for (int i = 0; i < elems; ++i) {
+        assert(contains(p, keys[i]));
+    }
+
+    int k = elems - 1 - elems / 1000;
+    std::nth_element(latency.begin(), latency.begin() + k, latency.end());
+    double p999 = latency[k];
+    double max_latency = *std::max_element(latency.begin() + k, latency.end());
+    printf("%-6s %s: %d elements in %lf seconds (%.0lf inserts/sec), "
+           "p99.9 latency: %.3lf ms, max latency: %.3lf ms, %llu moves\n",
+           name, mode, p.size(), secs, elems / secs, p999 / 1000.0,
+           max_latency / 1000.0, nmoves);
+}
+
+int
+main(int argc, char **argv) {
+    const char *mode = argc > 1 ? argv[1] : "hammer";
+    int elems = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    benchmark<PMA<> >("PMA", mode, elems);
+    benchmark<PDPMA>("PDPMA", mode, elems);
+}
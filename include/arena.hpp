@@ -0,0 +1,253 @@
+#if !defined ARENA_HPP
+#define ARENA_HPP
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+// Arrays of at least this many bytes get a mapping of their own,
+// aligned to and madvise()d for huge pages; smaller ones come from
+// operator new, aligned to a page if they are at least that big and
+// to a cache line if not (so chunks of a line or a page line up with
+// them, see byte_geometry).
+#if !defined ARENA_MIN_MAP
+#define ARENA_MIN_MAP (2 << 20)
+#endif
+#define ARENA_HUGE_PAGE (2 << 20)
+#define ARENA_PAGE 4096
+#define ARENA_LINE 64
+// Freed mappings are kept for reuse up to this many bytes in all.
+#if !defined ARENA_CACHE_BYTES
+#define ARENA_CACHE_BYTES (256 << 20)
+#endif
+
+// An allocator that default-initializes (i.e. leaves alone) the
+// elements of a vector that is sized with vector(n) or resize(n).
+// Allocating a large array then doesn't touch every page up front.
+template <typename T>
+struct lazy_allocator : std::allocator<T> {
+    template <typename U>
+    struct rebind {
+        typedef lazy_allocator<U> other;
+    };
+
+    lazy_allocator()
+    { }
+
+    template <typename U>
+    lazy_allocator(const lazy_allocator<U> &)
+    { }
+
+    template <typename U>
+    void
+    construct(U *p) {
+        ::new ((void*)p) U;
+    }
+
+    template <typename U, typename... Args>
+    void
+    construct(U *p, Args&&... args) {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+};
+
+// Where arena_allocator gets its memory. A large array is a private
+// anonymous mapping of whole huge pages, so random lookups into it
+// take one TLB entry per 2 MB instead of per 4 KB. A freed mapping is
+// kept (while the cache has room) and handed to the next large array,
+// grown with mremap() or shrunk to its size: after a resize has freed
+// the old array, the next one reuses its pages, so growing only maps
+// the difference.
+struct page_arena {
+    struct mapping {
+        char *p;
+        size_t len;
+    };
+
+    std::mutex lock;
+    std::vector<mapping> cache;
+    size_t cached;
+    // Mappings made and reused (for benchmarks)
+    long nmapped;
+    long nreused;
+
+    page_arena()
+        : cached(0), nmapped(0), nreused(0)
+    { }
+
+    // Never destroyed, so arrays freed by static destructors still
+    // have somewhere to go.
+    static page_arena&
+    instance() {
+        static page_arena *a = new page_arena;
+        return *a;
+    }
+
+    static size_t
+    round_up(size_t n, size_t to) {
+        return (n + to - 1) / to * to;
+    }
+
+    // 'len' bytes at a huge-page boundary with protection 'prot'.
+    static char*
+    map_aligned(size_t len, int prot) {
+        void *m = mmap(NULL, len + ARENA_HUGE_PAGE, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+            return NULL;
+        }
+        char *r = (char*)m;
+        char *p = (char*)round_up((uintptr_t)r, ARENA_HUGE_PAGE);
+        if (p > r) {
+            munmap(r, p - r);
+        }
+        munmap(p + len, r + len + ARENA_HUGE_PAGE - p - len);
+        return p;
+    }
+
+    // Mapping 'm' resized to 'len' bytes, still aligned: shrunk in
+    // place, or grown in place if the address space after it is free
+    // and moved (page tables only) to an aligned range if not. NULL
+    // if it can't be grown.
+    static char*
+    resize(const mapping &m, size_t len) {
+        if (len <= m.len) {
+            if (len < m.len) {
+                munmap(m.p + len, m.len - len);
+            }
+            return m.p;
+        }
+        void *q = mremap(m.p, m.len, len, 0);
+        if (q == MAP_FAILED) {
+            char *r = map_aligned(len, PROT_NONE);
+            if (!r) {
+                return NULL;
+            }
+            q = mremap(m.p, m.len, len, MREMAP_MAYMOVE | MREMAP_FIXED, r);
+            if (q == MAP_FAILED) {
+                munmap(r, len);
+                return NULL;
+            }
+        }
+        madvise(q, len, MADV_HUGEPAGE);
+        return (char*)q;
+    }
+
+    // Whether a cached mapping of 'a' bytes makes a better array of
+    // 'len' bytes than one of 'b' bytes: the same size, else the
+    // largest smaller one, else the smallest larger one.
+    static bool
+    better(size_t a, size_t b, size_t len) {
+        if (b == len || a == len) {
+            return a == len && b != len;
+        }
+        if (a < len) {
+            return b > len || a > b;
+        }
+        return b > len && a < b;
+    }
+
+    // Alignment of an array of 'bytes' bytes from operator new.
+    static size_t
+    small_align(size_t bytes) {
+        return bytes >= ARENA_PAGE ? ARENA_PAGE : ARENA_LINE;
+    }
+
+    void*
+    allocate(size_t bytes) {
+        if (bytes < ARENA_MIN_MAP) {
+            return ::operator new(bytes, std::align_val_t(small_align(bytes)));
+        }
+        size_t len = round_up(bytes, ARENA_HUGE_PAGE);
+        {
+            std::lock_guard<std::mutex> g(this->lock);
+            int best = -1;
+            for (int i = 0; i < (int)this->cache.size(); ++i) {
+                if (best < 0 || better(this->cache[i].len, this->cache[best].len, len)) {
+                    best = i;
+                }
+            }
+            if (best >= 0) {
+                mapping m = this->cache[best];
+                this->cache.erase(this->cache.begin() + best);
+                this->cached -= m.len;
+                char *p = resize(m, len);
+                if (p) {
+                    ++this->nreused;
+                    return p;
+                }
+                munmap(m.p, m.len);
+            }
+            ++this->nmapped;
+        }
+        char *p = map_aligned(len, PROT_READ | PROT_WRITE);
+        if (!p) {
+            throw std::bad_alloc();
+        }
+        madvise(p, len, MADV_HUGEPAGE);
+        return p;
+    }
+
+    void
+    deallocate(void *p, size_t bytes) {
+        if (bytes < ARENA_MIN_MAP) {
+            ::operator delete(p, std::align_val_t(small_align(bytes)));
+            return;
+        }
+        mapping m = { (char*)p, round_up(bytes, ARENA_HUGE_PAGE) };
+        {
+            std::lock_guard<std::mutex> g(this->lock);
+            if (this->cached + m.len <= ARENA_CACHE_BYTES) {
+                this->cache.push_back(m);
+                this->cached += m.len;
+                return;
+            }
+        }
+        munmap(m.p, m.len);
+    }
+
+    // Unmap the cached mappings.
+    void
+    trim() {
+        std::lock_guard<std::mutex> g(this->lock);
+        for (const mapping &m : this->cache) {
+            munmap(m.p, m.len);
+        }
+        this->cache.clear();
+        this->cached = 0;
+    }
+};
+
+// A lazy_allocator whose memory comes from page_arena. Pass it as
+// PMA's 'Alloc' (it is the default) or use it for any other array.
+template <typename T>
+struct arena_allocator : lazy_allocator<T> {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+        typedef arena_allocator<U> other;
+    };
+
+    arena_allocator()
+    { }
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &)
+    { }
+
+    T*
+    allocate(size_t n) {
+        return (T*)page_arena::instance().allocate(n * sizeof(T));
+    }
+
+    void
+    deallocate(T *p, size_t n) {
+        page_arena::instance().deallocate(p, n * sizeof(T));
+    }
+};
+
+#endif // ARENA_HPP
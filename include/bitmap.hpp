@@ -0,0 +1,221 @@
+#if !defined BITMAP_HPP
+#define BITMAP_HPP
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+// The read-only operations of a bitmap over words it doesn't own
+// (e.g. ones in a mapped file, see MappedPMA).
+struct bitmap_view {
+    const uint64_t *words;
+    int nbits;
+
+    bitmap_view(const uint64_t *w = NULL, int n = 0)
+        : words(w), nbits(n)
+    { }
+
+    int
+    size() const {
+        return this->nbits;
+    }
+
+    bool
+    operator[](int i) const {
+        return (this->words[i >> 6] >> (i & 63)) & 1;
+    }
+
+    // Bits [0, n) of a word
+    static uint64_t
+    mask_below(int n) {
+        return n >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+    }
+
+    // Number of set bits in [l, r)
+    int
+    count(int l, int r) const {
+        if (l >= r) {
+            return 0;
+        }
+        int wl = l >> 6, wr = (r - 1) >> 6;
+        uint64_t first = this->words[wl] & ~mask_below(l & 63);
+        if (wl == wr) {
+            return __builtin_popcountll(first & mask_below(((r - 1) & 63) + 1));
+        }
+        int c = __builtin_popcountll(first);
+        for (int w = wl + 1; w < wr; ++w) {
+            c += __builtin_popcountll(this->words[w]);
+        }
+        return c + __builtin_popcountll(this->words[wr] & mask_below(((r - 1) & 63) + 1));
+    }
+
+    // Index of the first set bit in [i, end), or 'end' if there is
+    // none.
+    int
+    next(int i, int end) const {
+        if (i >= end) {
+            return end;
+        }
+        int w = i >> 6;
+        uint64_t bits = this->words[w] & ~mask_below(i & 63);
+        int wend = (end + 63) >> 6;
+        while (!bits) {
+            if (++w >= wend) {
+                return end;
+            }
+            bits = this->words[w];
+        }
+        int j = (w << 6) + __builtin_ctzll(bits);
+        return j < end ? j : end;
+    }
+
+    // Index of the last set bit in [begin, i), or -1 if there is
+    // none.
+    int
+    prev(int begin, int i) const {
+        if (i <= begin) {
+            return -1;
+        }
+        int w = (i - 1) >> 6;
+        uint64_t bits = this->words[w] & mask_below(((i - 1) & 63) + 1);
+        int wbegin = begin >> 6;
+        while (!bits) {
+            if (--w < wbegin) {
+                return -1;
+            }
+            bits = this->words[w];
+        }
+        int j = (w << 6) + 63 - __builtin_clzll(bits);
+        return j >= begin ? j : -1;
+    }
+};
+
+// An occupancy bitmap packed into 64-bit words. Counting, searching
+// and clearing a range of slots work a word (i.e. 64 slots) at a
+// time. Bits past size() are always 0.
+struct bitmap {
+    std::vector<uint64_t> words;
+    int nbits;
+
+    bitmap(int n = 0)
+        : words((n + 63) / 64), nbits(n)
+    { }
+
+    int
+    size() const {
+        return this->nbits;
+    }
+
+    // New bits are cleared.
+    void
+    resize(int n) {
+        if (n < this->nbits) {
+            this->words.resize((n + 63) / 64);
+            if (n % 64) {
+                this->words.back() &= mask_below(n % 64);
+            }
+        } else {
+            this->words.resize((n + 63) / 64, 0);
+        }
+        this->nbits = n;
+    }
+
+    void
+    reserve(int n) {
+        this->words.reserve((n + 63) / 64);
+    }
+
+    void
+    assign(int n, bool v) {
+        this->words.assign((n + 63) / 64, v ? ~(uint64_t)0 : 0);
+        this->nbits = n;
+        if (v && n % 64) {
+            this->words.back() &= mask_below(n % 64);
+        }
+    }
+
+    void
+    swap(bitmap &rhs) {
+        this->words.swap(rhs.words);
+        std::swap(this->nbits, rhs.nbits);
+    }
+
+    bool
+    operator[](int i) const {
+        return (this->words[i >> 6] >> (i & 63)) & 1;
+    }
+
+    void
+    set(int i) {
+        this->words[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+
+    void
+    reset(int i) {
+        this->words[i >> 6] &= ~((uint64_t)1 << (i & 63));
+    }
+
+    void
+    set(int i, bool v) {
+        if (v) {
+            this->set(i);
+        } else {
+            this->reset(i);
+        }
+    }
+
+    // Bits [0, n) of a word
+    static uint64_t
+    mask_below(int n) {
+        return bitmap_view::mask_below(n);
+    }
+
+    bitmap_view
+    view() const {
+        return bitmap_view(this->words.data(), this->nbits);
+    }
+
+    // Number of set bits in [l, r)
+    int
+    count(int l, int r) const {
+        return this->view().count(l, r);
+    }
+
+    // Index of the first set bit in [i, end), or 'end' if there is
+    // none.
+    int
+    next(int i, int end) const {
+        return this->view().next(i, end);
+    }
+
+    // Index of the last set bit in [begin, i), or -1 if there is
+    // none.
+    int
+    prev(int begin, int i) const {
+        return this->view().prev(begin, i);
+    }
+
+    // Clear bits [l, r)
+    void
+    clear(int l, int r) {
+        if (l >= r) {
+            return;
+        }
+        int wl = l >> 6, wr = (r - 1) >> 6;
+        uint64_t lmask = ~mask_below(l & 63);
+        uint64_t rmask = mask_below(((r - 1) & 63) + 1);
+        if (wl == wr) {
+            this->words[wl] &= ~(lmask & rmask);
+            return;
+        }
+        this->words[wl] &= ~lmask;
+        for (int w = wl + 1; w < wr; ++w) {
+            this->words[w] = 0;
+        }
+        this->words[wr] &= ~rmask;
+    }
+};
+
+#endif // BITMAP_HPP
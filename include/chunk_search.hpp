@@ -0,0 +1,553 @@
+#if !defined CHUNK_SEARCH_HPP
+#define CHUNK_SEARCH_HPP
+
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include "bitmap.hpp"
+
+#if defined __x86_64__
+#include <immintrin.h>
+#define CHUNK_SEARCH_X86 1
+#endif
+
+// Kernels that compare up to 64 consecutive keys against a key and
+// return the result as a bitmask (bit i for key i). Masking that with
+// the occupancy bitmap and taking the ctz finds the first occupied
+// slot that satisfies the comparison without a branch per slot. The
+// widest kernel the CPU supports (AVX2, then SSE4.2) is picked at
+// startup, unless CHUNK_SEARCH_SCALAR is defined.
+//
+// LT selects a[i] < v, otherwise a[i] > v.
+
+template <typename K>
+struct cmp_mask {
+    typedef uint64_t (*fn)(const K *, int, K);
+};
+
+template <typename K, bool LT>
+uint64_t
+cmp_mask_scalar(const K *a, int n, K v) {
+    uint64_t m = 0;
+    for (int i = 0; i < n; ++i) {
+        m |= (uint64_t)(LT ? a[i] < v : a[i] > v) << i;
+    }
+    return m;
+}
+
+// The integer type of 'Size' bytes, or void if there is none.
+template <size_t Size, bool Signed>
+struct fixed_int {
+    typedef void type;
+};
+
+template <> struct fixed_int<1, true> { typedef int8_t type; };
+template <> struct fixed_int<1, false> { typedef uint8_t type; };
+template <> struct fixed_int<2, true> { typedef int16_t type; };
+template <> struct fixed_int<2, false> { typedef uint16_t type; };
+template <> struct fixed_int<4, true> { typedef int32_t type; };
+template <> struct fixed_int<4, false> { typedef uint32_t type; };
+template <> struct fixed_int<8, true> { typedef int64_t type; };
+template <> struct fixed_int<8, false> { typedef uint64_t type; };
+
+// The machine type a key is compared as, or void if there is no
+// kernel for it.
+template <typename K, bool = std::is_integral<K>::value>
+struct simd_key {
+    typedef typename fixed_int<sizeof(K), std::is_signed<K>::value>::type type;
+};
+
+template <typename K>
+struct simd_key<K, false> {
+    typedef void type;
+};
+
+template <>
+struct simd_key<float, false> {
+    typedef float type;
+};
+
+template <>
+struct simd_key<double, false> {
+    typedef double type;
+};
+
+#if defined CHUNK_SEARCH_X86
+// One struct per machine type: W lanes per vector, and cmp<LT>()
+// returns a movemask bit per lane.
+template <typename C> struct sse_lanes;
+template <typename C> struct avx2_lanes;
+
+#define SSE_TARGET __attribute__((target("sse4.2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+template <>
+struct sse_lanes<int8_t> {
+    enum { W = 16 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, int8_t v) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        __m128i vv = _mm_set1_epi8(v);
+        return _mm_movemask_epi8(LT ? _mm_cmpgt_epi8(vv, x) : _mm_cmpgt_epi8(x, vv));
+    }
+};
+
+template <>
+struct sse_lanes<uint8_t> {
+    enum { W = 16 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, uint8_t v) {
+        __m128i flip = _mm_set1_epi8(INT8_MIN);
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), flip);
+        __m128i vv = _mm_xor_si128(_mm_set1_epi8(v), flip);
+        return _mm_movemask_epi8(LT ? _mm_cmpgt_epi8(vv, x) : _mm_cmpgt_epi8(x, vv));
+    }
+};
+
+// Pack the 16-bit results to bytes to get one bit per lane.
+template <>
+struct sse_lanes<int16_t> {
+    enum { W = 8 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, int16_t v) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        __m128i vv = _mm_set1_epi16(v);
+        __m128i c = LT ? _mm_cmpgt_epi16(vv, x) : _mm_cmpgt_epi16(x, vv);
+        return _mm_movemask_epi8(_mm_packs_epi16(c, _mm_setzero_si128()));
+    }
+};
+
+template <>
+struct sse_lanes<uint16_t> {
+    enum { W = 8 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, uint16_t v) {
+        __m128i flip = _mm_set1_epi16(INT16_MIN);
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), flip);
+        __m128i vv = _mm_xor_si128(_mm_set1_epi16(v), flip);
+        __m128i c = LT ? _mm_cmpgt_epi16(vv, x) : _mm_cmpgt_epi16(x, vv);
+        return _mm_movemask_epi8(_mm_packs_epi16(c, _mm_setzero_si128()));
+    }
+};
+
+template <>
+struct sse_lanes<int32_t> {
+    enum { W = 4 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, int32_t v) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        __m128i vv = _mm_set1_epi32(v);
+        __m128i c = LT ? _mm_cmpgt_epi32(vv, x) : _mm_cmpgt_epi32(x, vv);
+        return _mm_movemask_ps(_mm_castsi128_ps(c));
+    }
+};
+
+template <>
+struct sse_lanes<uint32_t> {
+    enum { W = 4 };
+
+    // Flip the sign bits and compare as signed.
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, uint32_t v) {
+        __m128i flip = _mm_set1_epi32(INT32_MIN);
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), flip);
+        __m128i vv = _mm_xor_si128(_mm_set1_epi32(v), flip);
+        __m128i c = LT ? _mm_cmpgt_epi32(vv, x) : _mm_cmpgt_epi32(x, vv);
+        return _mm_movemask_ps(_mm_castsi128_ps(c));
+    }
+};
+
+template <>
+struct sse_lanes<int64_t> {
+    enum { W = 2 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, int64_t v) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        __m128i vv = _mm_set1_epi64x(v);
+        __m128i c = LT ? _mm_cmpgt_epi64(vv, x) : _mm_cmpgt_epi64(x, vv);
+        return _mm_movemask_pd(_mm_castsi128_pd(c));
+    }
+};
+
+template <>
+struct sse_lanes<uint64_t> {
+    enum { W = 2 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, uint64_t v) {
+        __m128i flip = _mm_set1_epi64x(INT64_MIN);
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), flip);
+        __m128i vv = _mm_xor_si128(_mm_set1_epi64x(v), flip);
+        __m128i c = LT ? _mm_cmpgt_epi64(vv, x) : _mm_cmpgt_epi64(x, vv);
+        return _mm_movemask_pd(_mm_castsi128_pd(c));
+    }
+};
+
+template <>
+struct sse_lanes<float> {
+    enum { W = 4 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, float v) {
+        __m128 x = _mm_loadu_ps((const float*)p);
+        __m128 vv = _mm_set1_ps(v);
+        return _mm_movemask_ps(LT ? _mm_cmplt_ps(x, vv) : _mm_cmpgt_ps(x, vv));
+    }
+};
+
+template <>
+struct sse_lanes<double> {
+    enum { W = 2 };
+
+    template <bool LT>
+    static SSE_TARGET int
+    cmp(const void *p, double v) {
+        __m128d x = _mm_loadu_pd((const double*)p);
+        __m128d vv = _mm_set1_pd(v);
+        return _mm_movemask_pd(LT ? _mm_cmplt_pd(x, vv) : _mm_cmpgt_pd(x, vv));
+    }
+};
+
+template <>
+struct avx2_lanes<int8_t> {
+    enum { W = 32 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, int8_t v) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        __m256i vv = _mm256_set1_epi8(v);
+        return _mm256_movemask_epi8(LT ? _mm256_cmpgt_epi8(vv, x) : _mm256_cmpgt_epi8(x, vv));
+    }
+};
+
+template <>
+struct avx2_lanes<uint8_t> {
+    enum { W = 32 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, uint8_t v) {
+        __m256i flip = _mm256_set1_epi8(INT8_MIN);
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), flip);
+        __m256i vv = _mm256_xor_si256(_mm256_set1_epi8(v), flip);
+        return _mm256_movemask_epi8(LT ? _mm256_cmpgt_epi8(vv, x) : _mm256_cmpgt_epi8(x, vv));
+    }
+};
+
+// packs works within each 128-bit half, so the bytes of lanes 0-7
+// and 8-15 come out in the even quarters of the mask.
+template <>
+struct avx2_lanes<int16_t> {
+    enum { W = 16 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, int16_t v) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        __m256i vv = _mm256_set1_epi16(v);
+        __m256i c = LT ? _mm256_cmpgt_epi16(vv, x) : _mm256_cmpgt_epi16(x, vv);
+        unsigned m = _mm256_movemask_epi8(_mm256_packs_epi16(c, c));
+        return (m & 0xff) | ((m >> 8) & 0xff00);
+    }
+};
+
+template <>
+struct avx2_lanes<uint16_t> {
+    enum { W = 16 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, uint16_t v) {
+        __m256i flip = _mm256_set1_epi16(INT16_MIN);
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), flip);
+        __m256i vv = _mm256_xor_si256(_mm256_set1_epi16(v), flip);
+        __m256i c = LT ? _mm256_cmpgt_epi16(vv, x) : _mm256_cmpgt_epi16(x, vv);
+        unsigned m = _mm256_movemask_epi8(_mm256_packs_epi16(c, c));
+        return (m & 0xff) | ((m >> 8) & 0xff00);
+    }
+};
+
+template <>
+struct avx2_lanes<int32_t> {
+    enum { W = 8 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, int32_t v) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        __m256i vv = _mm256_set1_epi32(v);
+        __m256i c = LT ? _mm256_cmpgt_epi32(vv, x) : _mm256_cmpgt_epi32(x, vv);
+        return _mm256_movemask_ps(_mm256_castsi256_ps(c));
+    }
+};
+
+template <>
+struct avx2_lanes<uint32_t> {
+    enum { W = 8 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, uint32_t v) {
+        __m256i flip = _mm256_set1_epi32(INT32_MIN);
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), flip);
+        __m256i vv = _mm256_xor_si256(_mm256_set1_epi32(v), flip);
+        __m256i c = LT ? _mm256_cmpgt_epi32(vv, x) : _mm256_cmpgt_epi32(x, vv);
+        return _mm256_movemask_ps(_mm256_castsi256_ps(c));
+    }
+};
+
+template <>
+struct avx2_lanes<int64_t> {
+    enum { W = 4 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, int64_t v) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        __m256i vv = _mm256_set1_epi64x(v);
+        __m256i c = LT ? _mm256_cmpgt_epi64(vv, x) : _mm256_cmpgt_epi64(x, vv);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(c));
+    }
+};
+
+template <>
+struct avx2_lanes<uint64_t> {
+    enum { W = 4 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, uint64_t v) {
+        __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), flip);
+        __m256i vv = _mm256_xor_si256(_mm256_set1_epi64x(v), flip);
+        __m256i c = LT ? _mm256_cmpgt_epi64(vv, x) : _mm256_cmpgt_epi64(x, vv);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(c));
+    }
+};
+
+template <>
+struct avx2_lanes<float> {
+    enum { W = 8 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, float v) {
+        __m256 x = _mm256_loadu_ps((const float*)p);
+        __m256 vv = _mm256_set1_ps(v);
+        return _mm256_movemask_ps(_mm256_cmp_ps(x, vv, LT ? _CMP_LT_OQ : _CMP_GT_OQ));
+    }
+};
+
+template <>
+struct avx2_lanes<double> {
+    enum { W = 4 };
+
+    template <bool LT>
+    static AVX2_TARGET int
+    cmp(const void *p, double v) {
+        __m256d x = _mm256_loadu_pd((const double*)p);
+        __m256d vv = _mm256_set1_pd(v);
+        return _mm256_movemask_pd(_mm256_cmp_pd(x, vv, LT ? _CMP_LT_OQ : _CMP_GT_OQ));
+    }
+};
+
+template <typename K, typename L, typename C, bool LT>
+SSE_TARGET uint64_t
+cmp_mask_sse(const K *a, int n, K v) {
+    uint64_t m = 0;
+    int i = 0;
+    for (; i + L::W <= n; i += L::W) {
+        m |= (uint64_t)(uint32_t)L::template cmp<LT>(a + i, (C)v) << i;
+    }
+    if (i < n) {
+        m |= cmp_mask_scalar<K, LT>(a + i, n - i, v) << i;
+    }
+    return m;
+}
+
+template <typename K, typename L, typename C, bool LT>
+AVX2_TARGET uint64_t
+cmp_mask_avx2(const K *a, int n, K v) {
+    uint64_t m = 0;
+    int i = 0;
+    for (; i + L::W <= n; i += L::W) {
+        m |= (uint64_t)(uint32_t)L::template cmp<LT>(a + i, (C)v) << i;
+    }
+    if (i < n) {
+        m |= cmp_mask_scalar<K, LT>(a + i, n - i, v) << i;
+    }
+    return m;
+}
+
+#undef SSE_TARGET
+#undef AVX2_TARGET
+#endif
+
+template <typename K, bool LT, typename C>
+typename cmp_mask<K>::fn
+pick_cmp_mask(C *) {
+#if defined CHUNK_SEARCH_X86 && !defined CHUNK_SEARCH_SCALAR
+    // We may run from a static initializer, before libgcc has
+    // initialized the CPU model.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return cmp_mask_avx2<K, avx2_lanes<C>, C, LT>;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return cmp_mask_sse<K, sse_lanes<C>, C, LT>;
+    }
+#endif
+    return cmp_mask_scalar<K, LT>;
+}
+
+template <typename K>
+struct cmp_kernels {
+    static const typename cmp_mask<K>::fn lt;
+    static const typename cmp_mask<K>::fn gt;
+};
+
+template <typename K>
+const typename cmp_mask<K>::fn cmp_kernels<K>::lt =
+    pick_cmp_mask<K, true>((typename simd_key<K>::type*)0);
+
+template <typename K>
+const typename cmp_mask<K>::fn cmp_kernels<K>::gt =
+    pick_cmp_mask<K, false>((typename simd_key<K>::type*)0);
+
+// comp(a[i], v) and comp(v, a[i]) as bitmasks. 'simd' says whether
+// there are kernels for them, i.e. whether K is an arithmetic type and
+// Compare is std::less or std::greater. Otherwise callers fall back to
+// calling 'comp' slot by slot.
+template <typename K, typename Compare,
+          bool = !std::is_void<typename simd_key<K>::type>::value>
+struct key_masks {
+    enum { simd = 0 };
+
+    static uint64_t
+    comp(const K *, int, const K &) {
+        return 0;
+    }
+
+    static uint64_t
+    rcomp(const K *, int, const K &) {
+        return 0;
+    }
+};
+
+template <typename K>
+struct key_masks<K, std::less<K>, true> {
+    enum { simd = 1 };
+
+    static uint64_t
+    comp(const K *a, int n, const K &v) {
+        return cmp_kernels<K>::lt(a, n, v);
+    }
+
+    static uint64_t
+    rcomp(const K *a, int n, const K &v) {
+        return cmp_kernels<K>::gt(a, n, v);
+    }
+};
+
+template <typename K>
+struct key_masks<K, std::greater<K>, true> {
+    enum { simd = 1 };
+
+    static uint64_t
+    comp(const K *a, int n, const K &v) {
+        return cmp_kernels<K>::gt(a, n, v);
+    }
+
+    static uint64_t
+    rcomp(const K *a, int n, const K &v) {
+        return cmp_kernels<K>::lt(a, n, v);
+    }
+};
+
+// Index of the first slot i in [l, e) with present[i] and
+// !comp(a[i], v) (i.e. a[i] >= v), or 'e' if there is none.
+template <typename K, typename Compare, typename Bits>
+int
+first_present_ge(const K *a, const Bits &present, int l, int e, const K &v, Compare comp) {
+    if (key_masks<K, Compare>::simd) {
+        while (l < e) {
+            int n = std::min(64 - (l & 63), e - l);
+            uint64_t m = ~key_masks<K, Compare>::comp(a + l, n, v) &
+                (present.words[l >> 6] >> (l & 63)) & bitmap::mask_below(n);
+            if (m) {
+                return l + __builtin_ctzll(m);
+            }
+            l += n;
+        }
+        return e;
+    }
+    for (int i = present.next(l, e); i < e; i = present.next(i + 1, e)) {
+        if (!comp(a[i], v)) {
+            return i;
+        }
+    }
+    return e;
+}
+
+// Index of the first slot i in [l, e) with present[i] and
+// !comp(v, a[i]) (i.e. a[i] <= v), or -1 if there is none.
+template <typename K, typename Compare, typename Bits>
+int
+first_present_le(const K *a, const Bits &present, int l, int e, const K &v, Compare comp) {
+    if (key_masks<K, Compare>::simd) {
+        while (l < e) {
+            int n = std::min(64 - (l & 63), e - l);
+            uint64_t m = ~key_masks<K, Compare>::rcomp(a + l, n, v) &
+                (present.words[l >> 6] >> (l & 63)) & bitmap::mask_below(n);
+            if (m) {
+                return l + __builtin_ctzll(m);
+            }
+            l += n;
+        }
+        return -1;
+    }
+    for (int i = present.next(l, e); i < e; i = present.next(i + 1, e)) {
+        if (!comp(v, a[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Index of the first slot i in [l, e) with !comp(a[i], v), or 'e' if
+// there is none, for a sorted 'a': the number of slots < v.
+template <typename K, typename Compare>
+int
+first_ge_sorted(const K *a, int l, int e, const K &v, Compare comp) {
+    if (key_masks<K, Compare>::simd) {
+        while (l < e) {
+            int n = std::min(64, e - l);
+            int c = __builtin_popcountll(key_masks<K, Compare>::comp(a + l, n, v));
+            if (c < n) {
+                return l + c;
+            }
+            l += n;
+        }
+        return e;
+    }
+    return std::lower_bound(a + l, a + e, v, comp) - a;
+}
+
+#endif // CHUNK_SEARCH_HPP
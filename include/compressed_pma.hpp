@@ -0,0 +1,474 @@
+#if !defined COMPRESSED_PMA_HPP
+#define COMPRESSED_PMA_HPP
+
+#include <limits>
+#include "pma.hpp"
+
+// A PMA of integer keys that stores each chunk as a frame of
+// reference: the chunk's smallest key ('base'), and the differences
+// of its keys from it, packed to the left of the chunk's
+// 'chunk_words' words of 'data'. The differences of a chunk are all
+// 1, 2, 4 or 8 bytes wide, the narrowest that holds its largest one,
+// so for dense ids a key takes a byte or two instead of its full
+// width plus the empty slots around it.
+//
+// Chunks are filled and spread by number of keys against the same
+// thresholds as in PMA. A chunk whose differences don't fit in
+// 'chunk_words' makes every chunk wider (see widen()), which only
+// moves words and happens a few times between resizes at most; a
+// resize picks the fewest words that hold the widest chunk. So a
+// single chunk of far-apart keys costs every chunk room for them.
+//
+// A lookup searches the chunk index, then compares the differences
+// of one chunk against 'v - base' with the SIMD kernels of
+// chunk_search.hpp. Scans decode a chunk at a time.
+template <typename Key = int64_t>
+struct CompressedPMA {
+    static_assert(std::is_integral<Key>::value, "chunks store differences of integer keys");
+    typedef typename std::make_unsigned<Key>::type ukey_t;
+
+    // Smallest key of each chunk
+    vector<Key> base;
+    // log2 of the bytes per difference of each chunk
+    vector<uint8_t> lgwidth;
+    // The differences of chunk c start at data[c * chunk_words]
+    vector<uint64_t> data;
+    // Number of keys in each window (the leaves are the chunks)
+    counts_tree counts;
+    // Largest key in each chunk
+    chunk_index<Key> index;
+    int nelems;
+    int chunk_size;
+    int chunk_words;
+    int nchunks;
+    int nlevels;
+    // PMA's default density thresholds as element counts
+    density_limits limits;
+    // Keys being moved
+    vector<Key> tmp;
+
+    CompressedPMA(int capacity = 2)
+        : nelems(0) {
+        assert(capacity > 1);
+        assert(1 << log2(capacity) == capacity);
+        this->spread_tmp(capacity);
+    }
+
+    // Bulk-load the sorted keys in [first, last) into the smallest
+    // array that is at most half full.
+    template <typename Iter>
+    void
+    load(Iter first, Iter last) {
+        this->tmp.assign(first, last);
+        assert(std::is_sorted(this->tmp.begin(), this->tmp.end()));
+        int capacity = 2;
+        while (capacity < 2 * (int)this->tmp.size()) {
+            capacity *= 2;
+        }
+        this->spread_tmp(capacity);
+    }
+
+    int
+    size() const {
+        return this->nelems;
+    }
+
+    int
+    capacity() const {
+        return this->nchunks * this->chunk_size;
+    }
+
+    int
+    count(int c) const {
+        return this->counts.at(0, c);
+    }
+
+    // Bytes of memory the arrays take.
+    size_t
+    bytes() const {
+        return sizeof(uint64_t) * this->data.size() + sizeof(Key) * this->base.size() +
+            this->lgwidth.size() + sizeof(int) * this->counts.cnt.size() +
+            sizeof(Key) * (this->index.key.size() + 1);
+    }
+
+    void
+    init_vars(int capacity) {
+        this->chunk_size = PMA<Key>::chunk_size_for(capacity);
+        assert(this->chunk_size <= 64);
+        this->nchunks = capacity / this->chunk_size;
+        this->nlevels = log2(this->nchunks);
+        this->limits.init<default_density>(this->chunk_size, this->nlevels);
+    }
+
+    // log2 of the bytes a difference of up to 'd' takes.
+    static int
+    lgwidth_for(ukey_t d) {
+        return d <= 0xff ? 0 : d <= 0xffff ? 1 : d <= 0xffffffff ? 2 : 3;
+    }
+
+    // Words the sorted keys k[0, n) take as one chunk.
+    static int
+    words_for(const Key *k, int n) {
+        if (n == 0) {
+            return 0;
+        }
+        int lg = lgwidth_for((ukey_t)k[n - 1] - (ukey_t)k[0]);
+        return ((n << lg) + 7) / 8;
+    }
+
+    // The first key in 'tmp' that chunk i of the 'nch' chunks it is
+    // spread over gets.
+    int
+    piece(int i, int nch) const {
+        return (int64_t)i * (int64_t)this->tmp.size() / nch;
+    }
+
+    template <typename D>
+    static void
+    unpack(const D *d, int n, ukey_t b, Key *out) {
+        for (int i = 0; i < n; ++i) {
+            out[i] = (Key)(b + (ukey_t)d[i]);
+        }
+    }
+
+    template <typename D>
+    static void
+    pack(const Key *k, int n, D *d) {
+        for (int i = 0; i < n; ++i) {
+            d[i] = (D)((ukey_t)k[i] - (ukey_t)k[0]);
+        }
+    }
+
+    // The keys of chunk 'c', in 'out'.
+    void
+    decode(int c, Key *out) const {
+        const void *d = &this->data[(size_t)c * this->chunk_words];
+        int n = this->count(c);
+        ukey_t b = this->base[c];
+        switch (this->lgwidth[c]) {
+        case 0: unpack((const uint8_t*)d, n, b, out); break;
+        case 1: unpack((const uint16_t*)d, n, b, out); break;
+        case 2: unpack((const uint32_t*)d, n, b, out); break;
+        default: unpack((const uint64_t*)d, n, b, out); break;
+        }
+    }
+
+    // Make chunk 'c' hold the sorted keys k[0, n), which fit in
+    // 'chunk_words'.
+    void
+    encode(int c, const Key *k, int n) {
+        void *d = &this->data[(size_t)c * this->chunk_words];
+        int lg = n ? lgwidth_for((ukey_t)k[n - 1] - (ukey_t)k[0]) : 0;
+        this->base[c] = n ? k[0] : Key();
+        this->lgwidth[c] = lg;
+        this->counts.cnt[this->counts.nleaves + c] = n;
+        switch (lg) {
+        case 0: pack(k, n, (uint8_t*)d); break;
+        case 1: pack(k, n, (uint16_t*)d); break;
+        case 2: pack(k, n, (uint32_t*)d); break;
+        default: pack(k, n, (uint64_t*)d); break;
+        }
+    }
+
+    // Key 'i' of chunk 'c'.
+    Key
+    key_at(int c, int i) const {
+        const void *d = &this->data[(size_t)c * this->chunk_words];
+        ukey_t b = this->base[c];
+        switch (this->lgwidth[c]) {
+        case 0: return (Key)(b + ((const uint8_t*)d)[i]);
+        case 1: return (Key)(b + ((const uint16_t*)d)[i]);
+        case 2: return (Key)(b + ((const uint32_t*)d)[i]);
+        default: return (Key)(b + ((const uint64_t*)d)[i]);
+        }
+    }
+
+    template <typename D>
+    static int
+    search(const D *d, int n, ukey_t t) {
+        if (t > (ukey_t)std::numeric_limits<D>::max()) {
+            return n;
+        }
+        return first_ge_sorted(d, 0, n, (D)t, std::less<D>());
+    }
+
+    // Index in chunk 'c' of its first key >= 'v', or its count if
+    // there is none.
+    int
+    lb_in_chunk(int c, const Key &v) const {
+        int n = this->count(c);
+        if (n == 0 || v <= this->base[c]) {
+            return 0;
+        }
+        const void *d = &this->data[(size_t)c * this->chunk_words];
+        ukey_t t = (ukey_t)v - (ukey_t)this->base[c];
+        switch (this->lgwidth[c]) {
+        case 0: return search((const uint8_t*)d, n, t);
+        case 1: return search((const uint16_t*)d, n, t);
+        case 2: return search((const uint32_t*)d, n, t);
+        default: return search((const uint64_t*)d, n, t);
+        }
+    }
+
+    // The first chunk with a key >= 'v', or nchunks if there is none.
+    int
+    lower_bound_chunk(const Key &v) const {
+        if (this->nelems == 0) {
+            return this->nchunks;
+        }
+        int c = this->index.search(v);
+        while (c < this->nchunks && this->count(c) == 0) {
+            ++c;
+        }
+        return c;
+    }
+
+    // The smallest key >= 'v', in 'out'. Returns false if there is
+    // none.
+    bool
+    lower_bound(const Key &v, Key &out) const {
+        int c = this->lower_bound_chunk(v);
+        if (c == this->nchunks) {
+            return false;
+        }
+        out = this->key_at(c, this->lb_in_chunk(c, v));
+        return true;
+    }
+
+    bool
+    find(const Key &v) const {
+        Key k;
+        return this->lower_bound(v, k) && k == v;
+    }
+
+    // Call f(k) for the keys in [lo, hi), in order.
+    template <typename F>
+    void
+    for_each_in_range(const Key &lo, const Key &hi, F f) const {
+        Key buf[64];
+        for (int c = this->lower_bound_chunk(lo); c < this->nchunks; ++c) {
+            int n = this->count(c);
+            this->decode(c, buf);
+            for (int i = 0; i < n; ++i) {
+                if (buf[i] >= hi) {
+                    return;
+                }
+                if (buf[i] >= lo) {
+                    f(buf[i]);
+                }
+            }
+        }
+    }
+
+    // Call f(k) for every key, in order.
+    template <typename F>
+    void
+    for_each(F f) const {
+        Key buf[64];
+        for (int c = 0; c < this->nchunks; ++c) {
+            int n = this->count(c);
+            this->decode(c, buf);
+            for (int i = 0; i < n; ++i) {
+                f(buf[i]);
+            }
+        }
+    }
+
+    void
+    insert(const Key &v) {
+        int c = this->lower_bound_chunk(v);
+        if (c == this->nchunks) {
+            // After every key: the last chunk with one
+            c = this->nchunks - 1;
+            while (c > 0 && this->count(c) == 0) {
+                --c;
+            }
+        }
+        if (this->count(c) < this->chunk_size) {
+            this->insert_merge(c, v);
+            return;
+        }
+        // Find the smallest window around 'c' that takes one more key
+        for (int level = 1; level <= this->nlevels; ++level) {
+            int q = c >> level;
+            if (this->counts.at(level, q) + 1 <= this->limits.max[level]) {
+                this->rebalance_interval(q << level, level, v);
+                return;
+            }
+        }
+        this->gather(0, this->nchunks);
+        this->spread_tmp(2 * this->capacity());
+        this->insert(v);
+    }
+
+    // Erase one copy of 'v'. Returns false if there is none. Chunks
+    // aren't merged and the array isn't shrunk.
+    bool
+    erase(const Key &v) {
+        int c = this->lower_bound_chunk(v);
+        if (c == this->nchunks) {
+            return false;
+        }
+        int j = this->lb_in_chunk(c, v);
+        if (this->key_at(c, j) != v) {
+            return false;
+        }
+        this->gather(c, c + 1);
+        this->tmp.erase(this->tmp.begin() + j);
+        this->write_chunks(c, 0);
+        --this->nelems;
+        return true;
+    }
+
+    void
+    insert_merge(int c, const Key &v) {
+        this->gather(c, c + 1);
+        this->tmp.insert(std::upper_bound(this->tmp.begin(), this->tmp.end(), v), v);
+        this->write_chunks(c, 0);
+        ++this->nelems;
+    }
+
+    // Spread the keys of the window of level 'level' starting at
+    // chunk 'first', and 'v', evenly over its chunks.
+    void
+    rebalance_interval(int first, int level, const Key &v) {
+        this->gather(first, first + (1 << level));
+        this->tmp.insert(std::upper_bound(this->tmp.begin(), this->tmp.end(), v), v);
+        this->write_chunks(first, level);
+        ++this->nelems;
+    }
+
+    // The keys of chunks [first, last), in 'tmp'.
+    void
+    gather(int first, int last) {
+        this->tmp.clear();
+        for (int c = first; c < last; ++c) {
+            int n = this->tmp.size();
+            this->tmp.resize(n + this->count(c));
+            this->decode(c, this->tmp.data() + n);
+        }
+    }
+
+    // Spread 'tmp' evenly over the window of level 'level' starting at
+    // chunk 'first', widening the chunks first if they need it.
+    void
+    write_chunks(int first, int level) {
+        int nch = 1 << level;
+        int words = 0;
+        for (int i = 0; i < nch; ++i) {
+            int l = this->piece(i, nch), r = this->piece(i + 1, nch);
+            words = std::max(words, words_for(this->tmp.data() + l, r - l));
+        }
+        if (words > this->chunk_words) {
+            this->widen(words);
+        }
+        int old = this->counts.at(level, first >> level);
+        for (int i = 0; i < nch; ++i) {
+            int l = this->piece(i, nch), r = this->piece(i + 1, nch);
+            this->encode(first + i, this->tmp.data() + l, r - l);
+        }
+        this->counts.update(level, first >> level, old);
+        this->refresh_index(first, first + nch);
+    }
+
+    // Give every chunk at least 'words' words (by doubling, so
+    // widening happens a few times at most).
+    void
+    widen(int words) {
+        int w = this->chunk_words;
+        while (w < words) {
+            w *= 2;
+        }
+        vector<uint64_t> wider((size_t)this->nchunks * w);
+        for (int c = 0; c < this->nchunks; ++c) {
+            std::copy(&this->data[(size_t)c * this->chunk_words],
+                      &this->data[(size_t)c * this->chunk_words] + this->chunk_words,
+                      &wider[(size_t)c * w]);
+        }
+        this->data.swap(wider);
+        this->chunk_words = w;
+    }
+
+    // Make the array 'capacity' slots and spread 'tmp' evenly over it,
+    // with the fewest words per chunk that hold the widest chunk.
+    void
+    spread_tmp(int capacity) {
+        assert((int)this->tmp.size() <= capacity);
+        this->init_vars(capacity);
+        this->counts.init(this->nchunks);
+        this->index.init(this->nchunks);
+        this->base.assign(this->nchunks, Key());
+        this->lgwidth.assign(this->nchunks, 0);
+        int words = 1;
+        for (int c = 0; c < this->nchunks; ++c) {
+            int l = this->piece(c, this->nchunks), r = this->piece(c + 1, this->nchunks);
+            words = std::max(words, words_for(this->tmp.data() + l, r - l));
+        }
+        this->chunk_words = 1;
+        while (this->chunk_words < words) {
+            this->chunk_words *= 2;
+        }
+        this->data.assign((size_t)this->nchunks * this->chunk_words, 0);
+        this->nelems = this->tmp.size();
+        if (this->nelems) {
+            this->write_chunks(0, this->nlevels);
+        }
+    }
+
+    // Recompute the index keys of chunks [first, last), and of the
+    // empty chunks after them that carry their key (see chunk_index).
+    void
+    refresh_index(int first, int last) {
+        bool leading = first == 0 || this->counts.prefix(first) == 0;
+        Key k = leading ? Key() : this->index.get(first - 1);
+        for (int c = first; c < this->nchunks; ++c) {
+            int n = this->count(c);
+            if (c >= last && n > 0) {
+                break;
+            }
+            if (n > 0) {
+                k = this->key_at(c, n - 1);
+                if (leading) {
+                    for (int b = 0; b < c; ++b) {
+                        this->index.set(b, k);
+                    }
+                    leading = false;
+                }
+            }
+            this->index.set(c, k);
+        }
+    }
+
+    // Debug check of the counts, the order of the keys and the index.
+    bool
+    verify() const {
+        for (int k = this->counts.nleaves - 1; k > 0; --k) {
+            if (this->counts.cnt[k] != this->counts.cnt[2*k] + this->counts.cnt[2*k + 1]) {
+                return false;
+            }
+        }
+        if (this->counts.total() != this->nelems) {
+            return false;
+        }
+        Key buf[64];
+        bool any = false;
+        Key prev = Key();
+        for (int c = 0; c < this->nchunks; ++c) {
+            int n = this->count(c);
+            this->decode(c, buf);
+            for (int i = 0; i < n; ++i) {
+                if (any && buf[i] < prev) {
+                    return false;
+                }
+                prev = buf[i];
+                any = true;
+            }
+            if (any && this->index.get(c) != prev) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif // COMPRESSED_PMA_HPP
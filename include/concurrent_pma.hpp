@@ -0,0 +1,702 @@
+#if !defined CONCURRENT_PMA_HPP
+#define CONCURRENT_PMA_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include "pma.hpp"
+
+static inline void
+cpu_relax() {
+#if defined __x86_64__
+    __builtin_ia32_pause();
+#endif
+}
+
+// A test-and-test-and-set lock: waiters spin on a plain load, so they
+// don't keep stealing the cache line from the holder.
+struct spin_lock {
+    std::atomic<bool> held;
+
+    spin_lock()
+        : held(false)
+    { }
+
+    void
+    lock() {
+        while (this->held.exchange(true, std::memory_order_acquire)) {
+            while (this->held.load(std::memory_order_relaxed)) {
+                cpu_relax();
+            }
+        }
+    }
+
+    void
+    unlock() {
+        this->held.store(false, std::memory_order_release);
+    }
+};
+
+#define MAX_EPOCH_THREADS 256
+
+// Epoch-based reclamation. A reader announces the global epoch in its
+// thread's slot while it reads; memory retired at epoch e is freed
+// once no slot holds an epoch <= e, i.e. once every reader that might
+// have seen it is done. Slots are handed out to threads on first use
+// and given back when the thread exits.
+struct epoch_domain {
+    struct slot {
+        std::atomic<unsigned long> epoch;
+        std::atomic<bool> used;
+        char pad[64 - sizeof(std::atomic<unsigned long>) - sizeof(std::atomic<bool>)];
+    };
+
+    // The slot (and guard nesting depth) of this thread
+    struct owner {
+        int i;
+        int depth;
+
+        owner()
+            : i(-1), depth(0)
+        { }
+
+        ~owner() {
+            if (this->i >= 0) {
+                epoch_domain::instance().slots[this->i].used.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    std::atomic<unsigned long> global;
+    slot slots[MAX_EPOCH_THREADS];
+
+    epoch_domain()
+        : global(1) {
+        for (int i = 0; i < MAX_EPOCH_THREADS; ++i) {
+            this->slots[i].epoch.store(0);
+            this->slots[i].used.store(false);
+        }
+    }
+
+    static epoch_domain&
+    instance() {
+        static epoch_domain d;
+        return d;
+    }
+
+    static owner&
+    me() {
+        static thread_local owner o;
+        return o;
+    }
+
+    void
+    enter() {
+        owner &o = me();
+        if (o.depth++) {
+            return;
+        }
+        if (o.i < 0) {
+            for (int i = 0; o.i < 0; i = (i + 1) % MAX_EPOCH_THREADS) {
+                bool f = false;
+                if (this->slots[i].used.compare_exchange_strong(f, true)) {
+                    o.i = i;
+                }
+            }
+        }
+        // seq_cst, so a writer that retires memory after we load the
+        // pointer to it sees our epoch.
+        this->slots[o.i].epoch.store(this->global.load());
+    }
+
+    void
+    exit() {
+        owner &o = me();
+        if (!--o.depth) {
+            this->slots[o.i].epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    // The epoch to tag memory with that was just unpublished.
+    unsigned long
+    retire() {
+        return this->global.fetch_add(1);
+    }
+
+    bool
+    safe(unsigned long e) const {
+        for (int i = 0; i < MAX_EPOCH_THREADS; ++i) {
+            unsigned long x = this->slots[i].epoch.load();
+            if (x && x <= e) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+struct epoch_guard {
+    epoch_guard() {
+        epoch_domain::instance().enter();
+    }
+
+    ~epoch_guard() {
+        epoch_domain::instance().exit();
+    }
+};
+
+// A PMA that several threads can insert into at once.
+//
+// Every lock covers 'group' chunks, enough to cover a whole word of
+// 'present', so two lock holders never write the same bitmap word.
+// An insert locks the chunk its key belongs to (and the one before
+// it, to read that chunk's largest key), and if the chunk is full
+// locks the windows above it one level at a time, always left to
+// right. A resize waits for every insert to finish: inserts hold
+// 'barrier' shared, a resize holds it exclusively.
+//
+// Under the chunk locks we only keep what belongs to the locked
+// chunks up to date: the leaves of the counts tree and the chunks'
+// index keys. This works as long as no chunk is empty (which inserts
+// can't undo), since then no chunk carries the key of another. Until
+// then, inserts go through the plain PMA one at a time, after sync()
+// has rebuilt the rest of the counts tree. Resizes spread the
+// elements evenly in one go, which leaves no chunk empty.
+//
+// Readers (lower_bound(), find(), for_each_in_range()) take no locks.
+// Each lock group has a version (a seqlock) that a writer makes odd
+// while it rewrites the group, and readers copy a group's elements and
+// retry if its version changed meanwhile. They reach the arrays
+// through a published 'table', and a resize publishes a new one and
+// hands the old arrays to epoch-based reclamation, so a reader never
+// waits for a resize either. (Before every chunk has an element, the
+// readers take 'barrier' like the inserts.)
+//
+// A lookup is linearizable: its answer is read from one consistent
+// state of the chunks it looks at. A scan is not a snapshot: it
+// reports keys in order, every key that is in the PMA for the whole
+// scan is reported exactly once, and keys inserted while it runs may
+// or may not be.
+//
+// Only keys (no values) and the default (non gap-free) mode are
+// supported. The index search that picks a chunk runs without locks
+// (racing with the writers of the index keys) and is only a hint: the
+// chunk is checked under its locks, and the insert moves one chunk
+// left or right until the key belongs there.
+template <typename Key = int, typename Compare = std::less<Key> >
+struct ConcurrentPMA {
+    typedef PMA<Key, Compare> pma_t;
+
+    // What readers see of the arrays: pointers into pma's arrays and
+    // index, and a version per lock group.
+    struct table {
+        const Key *impl;
+        const uint64_t *words;
+        const Key *index_key;
+        const Key *index_last;
+        int index_m;
+        int chunk_size;
+        int nchunks;
+        int group;
+        std::unique_ptr<std::atomic<unsigned>[]> versions;
+    };
+
+    // A table and the arrays it pointed to, once a resize replaced
+    // them, until no reader can see them.
+    struct retired {
+        unsigned long epoch;
+        std::unique_ptr<table> tab;
+        typename pma_t::keys_t impl;
+        vector<uint64_t> words;
+        vector<Key, lazy_allocator<Key> > index_key;
+    };
+
+    pma_t pma;
+    // NULL until every chunk has an element
+    std::atomic<table*> tab;
+    // Only changes under 'barrier'
+    vector<std::unique_ptr<retired> > retired_list;
+    std::shared_mutex barrier;
+    std::unique_ptr<spin_lock[]> locks;
+    int group;
+    std::atomic<int> nelems;
+    // Every chunk has an element. Only changes under 'barrier'.
+    bool dense;
+    // The inner nodes of pma.counts (and pma.nelems) are up to date
+    std::atomic<bool> synced;
+
+    ConcurrentPMA(int capacity = 2, const Compare &c = Compare())
+        : pma(capacity, c), tab(NULL), nelems(0), dense(false), synced(true) {
+        this->init_locks();
+    }
+
+    ~ConcurrentPMA() {
+        delete this->tab.load();
+    }
+
+    void
+    init_locks() {
+        this->group = std::max(1, 64 / this->pma.chunk_size);
+        int nlocks = (this->pma.nchunks + this->group - 1) / this->group;
+        this->locks.reset(new spin_lock[nlocks]);
+    }
+
+    // Lock (unlock) the locks that cover chunks [a, b).
+    void
+    lock_chunks(int a, int b) {
+        for (int g = a / this->group; g <= (b - 1) / this->group; ++g) {
+            this->locks[g].lock();
+        }
+    }
+
+    void
+    unlock_chunks(int a, int b) {
+        for (int g = a / this->group; g <= (b - 1) / this->group; ++g) {
+            this->locks[g].unlock();
+        }
+    }
+
+    int
+    chunk_count(int c) const {
+        return this->pma.counts.cnt[this->pma.counts.nleaves + c];
+    }
+
+    // Largest key of (nonempty) chunk 'c'.
+    const Key&
+    chunk_max(int c) const {
+        int cs = this->pma.chunk_size;
+        return this->pma.impl[this->pma.present.prev(c * cs, (c + 1) * cs)];
+    }
+
+    int
+    size() const {
+        return this->nelems.load(std::memory_order_relaxed);
+    }
+
+    void
+    insert(const Key &v) {
+        while (true) {
+            int cap;
+            {
+                std::shared_lock<std::shared_mutex> g(this->barrier);
+                if (this->dense && this->insert_locked(v)) {
+                    return;
+                }
+                cap = this->pma.impl.size();
+            }
+            std::unique_lock<std::shared_mutex> g(this->barrier);
+            this->sync_locked();
+            if (!this->dense) {
+                this->pma.insert(v);
+                this->pma.finish_resize();
+                this->nelems.store(this->pma.nelems, std::memory_order_relaxed);
+                if ((int)this->pma.impl.size() != cap) {
+                    // This publishes a table if the array is now dense.
+                    this->respread(this->pma.impl.size());
+                } else {
+                    this->check_dense();
+                    this->retire_table(this->publish());
+                }
+                return;
+            }
+            // The root window is full, unless another thread resized
+            // the array since we looked.
+            if ((int)this->pma.impl.size() == cap) {
+                this->respread(2 * cap);
+            }
+        }
+    }
+
+    // Resize to 'capacity' in one go, which spreads the elements
+    // evenly (an incremental resize can leave chunks empty). Unlike
+    // PMA::resize(), this keeps the old arrays for the readers that
+    // may still be in them.
+    void
+    respread(int capacity) {
+        pma_t &p = this->pma;
+        std::unique_ptr<retired> r(new retired);
+        typename pma_t::keys_t impl(capacity);
+        no_values vals;
+        bitmap present(capacity);
+        p.spread_into(impl, vals, present, capacity);
+        p.impl.swap(impl);
+        r->impl.swap(impl);
+        p.present.swap(present);
+        r->words.swap(present.words);
+        r->index_key.swap(p.index.key);
+        p.init_vars(capacity);
+        p.rebuild_counts();
+        p.rebuild_index();
+        nmoves += capacity;
+        this->init_locks();
+        this->check_dense();
+        r->tab.reset(this->publish());
+        r->epoch = epoch_domain::instance().retire();
+        this->retired_list.push_back(std::move(r));
+        this->reclaim();
+    }
+
+    // Publish a table for the current arrays (if readers may go
+    // without locks) and return the one it replaces.
+    table*
+    publish() {
+        if (!this->dense) {
+            return NULL;
+        }
+        pma_t &p = this->pma;
+        table *t = new table;
+        t->impl = p.impl.data();
+        t->words = p.present.words.data();
+        t->index_key = p.index.key.data();
+        t->index_last = &p.index.last;
+        t->index_m = p.index.m;
+        t->chunk_size = p.chunk_size;
+        t->nchunks = p.nchunks;
+        t->group = this->group;
+        int nlocks = (p.nchunks + this->group - 1) / this->group;
+        t->versions.reset(new std::atomic<unsigned>[nlocks]);
+        for (int g = 0; g < nlocks; ++g) {
+            t->versions[g].store(0, std::memory_order_relaxed);
+        }
+        return this->tab.exchange(t);
+    }
+
+    // Free table 't' (if any) once no reader can see it.
+    void
+    retire_table(table *t) {
+        if (!t) {
+            return;
+        }
+        std::unique_ptr<retired> r(new retired);
+        r->tab.reset(t);
+        r->epoch = epoch_domain::instance().retire();
+        this->retired_list.push_back(std::move(r));
+    }
+
+    // Free what no reader can see any more.
+    void
+    reclaim() {
+        epoch_domain &ed = epoch_domain::instance();
+        size_t k = 0;
+        for (size_t i = 0; i < this->retired_list.size(); ++i) {
+            if (!ed.safe(this->retired_list[i]->epoch)) {
+                this->retired_list[k++].swap(this->retired_list[i]);
+            }
+        }
+        this->retired_list.resize(k);
+    }
+
+    void
+    check_dense() {
+        this->dense = this->pma.nelems >= this->pma.nchunks;
+        for (int c = 0; this->dense && c < this->pma.nchunks; ++c) {
+            this->dense = this->chunk_count(c) > 0;
+        }
+    }
+
+    // Bring pma's counts tree and element count up to date, so that
+    // its (single-threaded) API can be used. No insert may be running.
+    pma_t&
+    sync() {
+        std::unique_lock<std::shared_mutex> g(this->barrier);
+        this->sync_locked();
+        return this->pma;
+    }
+
+    void
+    sync_locked() {
+        this->reclaim();
+        if (!this->synced.load(std::memory_order_relaxed)) {
+            this->pma.nelems = this->nelems.load(std::memory_order_relaxed);
+            this->pma.counts.rebuild(this->pma.present, this->pma.chunk_size,
+                                     this->pma.nlevels, 0);
+            this->synced.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // Insert 'v' under the chunk locks. Returns false (without
+    // inserting) if the root window is too full.
+    bool
+    insert_locked(const Key &v) {
+        const Compare &comp = this->pma.comp;
+        int n = this->pma.nchunks;
+        int c = std::min(this->pma.index.search(v), n - 1);
+        int level = 0;
+        while (level <= this->pma.nlevels) {
+            int wl = c & ~((1 << level) - 1), wr = wl + (1 << level);
+            int a = std::max(wl - 1, 0);
+            this->lock_chunks(a, wr);
+            // 'v' belongs in [wl, wr) if the chunk before it has a
+            // key < 'v' and its last chunk has a key >= 'v'.
+            int move = 0;
+            if (wl > 0 && !comp(this->chunk_max(wl - 1), v)) {
+                move = -1;
+            } else if (wr < n && comp(this->chunk_max(wr - 1), v)) {
+                move = 1;
+            }
+            if (move) {
+                this->unlock_chunks(a, wr);
+                c = move < 0 ? wl - 1 : wr;
+                level = 0;
+                continue;
+            }
+            int sz = 0;
+            for (int k = wl; k < wr; ++k) {
+                sz += this->chunk_count(k);
+            }
+            bool fits = level == 0 ? sz < this->pma.chunk_size
+                : sz + 1 <= this->pma.max_elems_at(level);
+            if (fits) {
+                this->merge_window(wl, level, v);
+                if (this->synced.load(std::memory_order_relaxed)) {
+                    this->synced.store(false, std::memory_order_relaxed);
+                }
+                this->unlock_chunks(a, wr);
+                this->nelems.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            this->unlock_chunks(a, wr);
+            ++level;
+        }
+        return false;
+    }
+
+    // Merge 'v' into the window of level 'level' starting at chunk
+    // 'wl': packed to the left for a single chunk (like
+    // PMA::insert_merge()), spread evenly otherwise. The window and
+    // the chunk before it are locked.
+    void
+    merge_window(int wl, int level, const Key &v) {
+        pma_t &p = this->pma;
+        int cs = p.chunk_size;
+        int left = wl * cs, w = (1 << level) * cs;
+        std::atomic<unsigned> *ver = this->tab.load(std::memory_order_relaxed)->versions.get();
+        int g0 = wl / this->group, g1 = (wl + (1 << level) - 1) / this->group;
+        for (int g = g0; g <= g1; ++g) {
+            ver[g].store(ver[g].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        p.spread_in_place(left, w, level == 0, &v, typename pma_t::mapped_type());
+        for (int c = wl; c < wl + (1 << level); ++c) {
+            p.counts.cnt[p.counts.nleaves + c] =
+                p.present.count(c * cs, (c + 1) * cs);
+            p.index.set(c, this->chunk_max(c));
+        }
+        for (int g = g0; g <= g1; ++g) {
+            ver[g].store(ver[g].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    }
+
+    // Copy the elements of chunks [c, end of c's lock group) of 't'
+    // to 'buf' ('nc' of them are in chunk c), and if 'prev' isn't
+    // NULL, the largest key of chunk c-1 to it. 's' and 'ps' get the
+    // versions of the groups of c and c-1. Returns false if a writer
+    // got in the way.
+    static bool
+    read_chunks(const table *t, int c, Key *buf, int &n, int &nc, Key *prev,
+                unsigned &s, unsigned &ps) {
+        int cs = t->chunk_size;
+        int g = c / t->group, pg = c > 0 ? (c - 1) / t->group : g;
+        s = t->versions[g].load(std::memory_order_acquire);
+        ps = t->versions[pg].load(std::memory_order_acquire);
+        if ((s | ps) & 1) {
+            return false;
+        }
+        int l = c * cs, ce = l + cs;
+        int e = std::min((g + 1) * t->group, t->nchunks) * cs;
+        n = nc = 0;
+        for (int w = l >> 6; w < (e + 63) >> 6; ++w) {
+            uint64_t bits = t->words[w];
+            if (w == l >> 6) {
+                bits &= ~bitmap::mask_below(l & 63);
+            }
+            for (; bits; bits &= bits - 1) {
+                int i = w * 64 + __builtin_ctzll(bits);
+                if (i >= e) {
+                    break;
+                }
+                nc += i < ce;
+                buf[n++] = t->impl[i];
+            }
+        }
+        if (prev) {
+            int i = -1;
+            for (int w = (l - 1) >> 6; i < 0 && w >= ((l - cs) >> 6); --w) {
+                uint64_t bits = t->words[w];
+                if (w == (l - 1) >> 6) {
+                    bits &= bitmap::mask_below(((l - 1) & 63) + 1);
+                }
+                if (w == (l - cs) >> 6) {
+                    bits &= ~bitmap::mask_below((l - cs) & 63);
+                }
+                if (bits) {
+                    i = w * 64 + 63 - __builtin_clzll(bits);
+                }
+            }
+            if (i < 0) {
+                return false;
+            }
+            *prev = t->impl[i];
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return t->versions[g].load(std::memory_order_relaxed) == s &&
+            t->versions[pg].load(std::memory_order_relaxed) == ps;
+    }
+
+    // Find the chunk 'v' belongs in (as insert_locked() does) and read
+    // its lock group from it on into 'buf'.
+    int
+    locate(const table *t, const Key &v, Key *buf, int &n, int &nc, unsigned &s) {
+        const Compare &comp = this->pma.comp;
+        int c = std::min(chunk_index<Key, Compare>::search(
+                             t->index_key, t->nchunks, t->index_m, *t->index_last, v, comp),
+                         t->nchunks - 1);
+        while (true) {
+            Key prev;
+            unsigned ps;
+            if (!read_chunks(t, c, buf, n, nc, c > 0 ? &prev : NULL, s, ps)) {
+                cpu_relax();
+            } else if (c > 0 && !comp(prev, v)) {
+                --c;
+            } else if (c < t->nchunks - 1 && (nc == 0 || comp(buf[nc - 1], v))) {
+                ++c;
+            } else {
+                return c;
+            }
+        }
+    }
+
+    // Scratch space for a lock group's elements
+    static Key*
+    read_buffer(const table *t) {
+        static thread_local vector<Key> buf;
+        if ((int)buf.size() < t->group * t->chunk_size) {
+            buf.resize(t->group * t->chunk_size);
+        }
+        return buf.data();
+    }
+
+    // The smallest key >= 'v', in 'out'. Returns false if there is
+    // none.
+    bool
+    lower_bound(const Key &v, Key &out) {
+        while (true) {
+            {
+                epoch_guard eg;
+                const table *t = this->tab.load();
+                if (t) {
+                    Key *buf = read_buffer(t);
+                    int n, nc;
+                    unsigned s;
+                    this->locate(t, v, buf, n, nc, s);
+                    for (int i = 0; i < nc; ++i) {
+                        if (!this->pma.comp(buf[i], v)) {
+                            out = buf[i];
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+            }
+            std::shared_lock<std::shared_mutex> g(this->barrier);
+            if (!this->tab.load()) {
+                int i = this->pma.lower_bound_slot(v);
+                if (i == (int)this->pma.impl.size()) {
+                    return false;
+                }
+                out = this->pma.impl[i];
+                return true;
+            }
+        }
+    }
+
+    bool
+    find(const Key &v) {
+        Key k;
+        return this->lower_bound(v, k) && !this->pma.comp(v, k);
+    }
+
+    // Call f(k) for the keys in [lo, hi), in order (see above for what
+    // a scan sees of concurrent inserts). The scan reads a lock group
+    // at a time, and goes on to the next group by position as long as
+    // the group before it didn't change in between; otherwise it
+    // looks up where it was by key: it has reported keys < 'k', and
+    // the first 'nk' keys equal to 'k'.
+    template <typename F>
+    void
+    for_each_in_range(const Key &lo, const Key &hi, F f) {
+        const Compare &comp = this->pma.comp;
+        if (!comp(lo, hi)) {
+            return;
+        }
+        Key k = lo;
+        int nk = 0;
+        while (true) {
+            {
+                epoch_guard eg;
+                const table *t = this->tab.load();
+                if (t) {
+                    if (this->scan_from(t, k, nk, hi, f)) {
+                        return;
+                    }
+                    continue;
+                }
+            }
+            std::shared_lock<std::shared_mutex> g(this->barrier);
+            if (!this->tab.load()) {
+                this->pma.for_each_in_range(lo, hi, f);
+                return;
+            }
+        }
+    }
+
+    // Scan from the 'nk'+1'th key equal to 'k' on. Returns true when
+    // done, false if the scan has to look up where it was again.
+    template <typename F>
+    bool
+    scan_from(const table *t, Key &k, int &nk, const Key &hi, F &f) {
+        const Compare &comp = this->pma.comp;
+        Key *buf = read_buffer(t);
+        int n, nc;
+        unsigned s, ps;
+        int c = this->locate(t, k, buf, n, nc, s);
+        int skip = nk;
+        while (true) {
+            for (int i = 0; i < n; ++i) {
+                const Key &x = buf[i];
+                if (comp(x, k)) {
+                    continue;
+                }
+                if (!comp(k, x)) {
+                    if (skip) {
+                        --skip;
+                        continue;
+                    }
+                    ++nk;
+                } else if (!comp(x, hi)) {
+                    return true;
+                } else {
+                    k = x;
+                    nk = 1;
+                }
+                f(x);
+            }
+            // The next group continues this one if this one is still
+            // as we read it.
+            unsigned prev_s = s;
+            c = (c / t->group + 1) * t->group;
+            if (c >= t->nchunks) {
+                return true;
+            }
+            while (!read_chunks(t, c, buf, n, nc, NULL, s, ps)) {
+                cpu_relax();
+            }
+            if (ps != prev_s) {
+                return false;
+            }
+        }
+    }
+};
+
+#endif // CONCURRENT_PMA_HPP
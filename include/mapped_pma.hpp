@@ -0,0 +1,218 @@
+#if !defined MAPPED_PMA_HPP
+#define MAPPED_PMA_HPP
+
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pma.hpp"
+
+// A PMA served straight from a file PMA::save() wrote. open() maps
+// the file and checks its header; the counts tree and the chunk index
+// are in the file too, so nothing is rebuilt, and a lookup only reads
+// the pages of the index and the chunk it ends up in. The first write
+// promotes the file to an in-memory PMA (a copy of its arrays), which
+// serves every read and write after that; the file isn't changed
+// until it's saved again.
+template <typename Key = int, typename Compare = std::less<Key> >
+struct MappedPMA {
+    typedef PMA<Key, Compare> pma_t;
+
+    // The mapping, NULL if nothing is mapped
+    char *base;
+    size_t len;
+    pma_file_header h;
+    const Key *impl;
+    bitmap_view present;
+    const int *counts;
+    const Key *index_key;
+    const Key *index_last;
+    int capacity;
+    int chunk_size;
+    int nchunks;
+    int index_m;
+    Compare comp;
+    // Where reads and writes go after the first write
+    std::unique_ptr<pma_t> promoted;
+
+    MappedPMA(const Compare &c = Compare())
+        : base(NULL), len(0), comp(c) {
+        memset(&this->h, 0, sizeof(this->h));
+    }
+
+    ~MappedPMA() {
+        this->close();
+    }
+
+    // Map the file at 'path'. Returns false if it can't be read or
+    // isn't a PMA file of this key type.
+    bool
+    open(const char *path) {
+        static_assert(std::is_trivially_copyable<Key>::value, "the file holds the keys' bytes");
+        this->close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        pma_file_header &h = this->h;
+        bool ok = fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+            !memcmp(h.magic, PMA_FILE_MAGIC, sizeof(h.magic)) &&
+            h.version == PMA_FILE_VERSION && h.key_size == sizeof(Key) &&
+            h.capacity > 1 && h.capacity <= INT_MAX && 1 << log2(h.capacity) == h.capacity &&
+            h.chunk_size == pma_t::chunk_size_for(h.capacity) &&
+            h.file_size <= st.st_size &&
+            this->fits(h.impl_off, sizeof(Key) * h.capacity) &&
+            this->fits(h.present_off, sizeof(uint64_t) * ((h.capacity + 63) / 64)) &&
+            this->fits(h.counts_off, sizeof(int) * 2 * (h.capacity / h.chunk_size)) &&
+            this->fits(h.index_off, sizeof(Key) * (h.capacity / h.chunk_size + 1));
+        void *m = ok ? mmap(NULL, h.file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (m == MAP_FAILED) {
+            return false;
+        }
+        this->base = (char*)m;
+        this->len = h.file_size;
+        this->impl = (const Key*)(this->base + h.impl_off);
+        this->present = bitmap_view((const uint64_t*)(this->base + h.present_off), h.capacity);
+        this->counts = (const int*)(this->base + h.counts_off);
+        this->capacity = h.capacity;
+        this->chunk_size = h.chunk_size;
+        this->nchunks = h.capacity / h.chunk_size;
+        this->index_key = (const Key*)(this->base + h.index_off);
+        this->index_last = this->index_key + this->nchunks;
+        this->index_m = log2(this->nchunks);
+        return true;
+    }
+
+    // Whether the section of 'bytes' bytes at 'off' is in the file
+    // (and aligned for the keys).
+    bool
+    fits(int64_t off, int64_t bytes) const {
+        return off >= (int64_t)sizeof(pma_file_header) && off % PMA_FILE_ALIGN == 0 &&
+            off + bytes <= this->h.file_size;
+    }
+
+    void
+    close() {
+        if (this->base) {
+            munmap(this->base, this->len);
+            this->base = NULL;
+        }
+        this->promoted.reset();
+    }
+
+    int
+    size() const {
+        return this->promoted ? this->promoted->size() : (int)this->h.nelems;
+    }
+
+    // Like PMA::lower_bound_slot(), on the mapped arrays.
+    int
+    lower_bound_slot(const Key &v) const {
+        if (this->h.nelems == 0) {
+            return this->capacity;
+        }
+        int c = chunk_index<Key, Compare>::search(this->index_key, this->nchunks, this->index_m,
+                                                  *this->index_last, v, this->comp);
+        while (c < this->nchunks && this->counts[this->nchunks + c] == 0) {
+            ++c;
+        }
+        if (c == this->nchunks) {
+            return this->capacity;
+        }
+        int l = c * this->chunk_size, e = l + this->chunk_size;
+        int j = first_present_ge(this->impl, this->present, l, e, v, this->comp);
+        return j < e ? j : this->present.next(j, this->capacity);
+    }
+
+    // The smallest key >= 'v', in 'out'. Returns false if there is
+    // none.
+    bool
+    lower_bound(const Key &v, Key &out) {
+        if (this->promoted) {
+            pma_t &p = *this->promoted;
+            int i = p.lower_bound_slot(v);
+            if (i == (int)p.impl.size()) {
+                return false;
+            }
+            out = p.impl[i];
+            return true;
+        }
+        int i = this->lower_bound_slot(v);
+        if (i == this->capacity) {
+            return false;
+        }
+        out = this->impl[i];
+        return true;
+    }
+
+    bool
+    find(const Key &v) {
+        Key k;
+        return this->lower_bound(v, k) && !this->comp(v, k);
+    }
+
+    // Call f(k) for the keys in [lo, hi), in order.
+    template <typename F>
+    void
+    for_each_in_range(const Key &lo, const Key &hi, F f) {
+        if (this->promoted) {
+            this->promoted->for_each_in_range(lo, hi, f);
+            return;
+        }
+        if (!this->comp(lo, hi)) {
+            return;
+        }
+        int l = this->lower_bound_slot(lo);
+        int h = this->lower_bound_slot(hi);
+        for (int i = this->present.next(l, h); i < h; i = this->present.next(i + 1, h)) {
+            f(this->impl[i]);
+        }
+    }
+
+    // Copy the mapped arrays into 'p'.
+    void
+    load_into(pma_t &p) const {
+        assert(this->base);
+        p.finish_resize();
+        p.init_vars(this->capacity);
+        p.impl.assign(this->impl, this->impl + this->capacity);
+        p.present.words.assign(this->present.words,
+                               this->present.words + (this->capacity + 63) / 64);
+        p.present.nbits = this->capacity;
+        p.counts.cnt.assign(this->counts, this->counts + 2 * this->nchunks);
+        p.counts.nleaves = this->nchunks;
+        p.index.init(this->nchunks);
+        std::copy(this->index_key, this->index_key + this->nchunks, p.index.key.begin());
+        p.index.last = *this->index_last;
+        p.nelems = this->h.nelems;
+        p.gap_free = this->h.gap_free;
+    }
+
+    // The in-memory PMA, made from the mapped file the first time.
+    pma_t&
+    pma() {
+        if (!this->promoted) {
+            pma_t *p = new pma_t(2, this->comp);
+            this->load_into(*p);
+            munmap(this->base, this->len);
+            this->base = NULL;
+            this->promoted.reset(p);
+        }
+        return *this->promoted;
+    }
+
+    void
+    insert(const Key &v) {
+        this->pma().insert(v);
+    }
+
+    bool
+    save(const char *path) {
+        return this->pma().save(path);
+    }
+};
+
+#endif // MAPPED_PMA_HPP
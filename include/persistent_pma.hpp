@@ -0,0 +1,440 @@
+#if !defined PERSISTENT_PMA_HPP
+#define PERSISTENT_PMA_HPP
+
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pma.hpp"
+#include "mapped_pma.hpp"
+
+#define PMA_LOG_INSERT 1
+#define PMA_LOG_ERASE 2
+#define PMA_JOURNAL_MAGIC "PMAJRNL"
+
+// FNV-1a hash of 'n' bytes, continuing from 'h'.
+inline uint64_t
+fnv1a(const void *p, size_t n, uint64_t h = 14695981039346656037ULL) {
+    const unsigned char *b = (const unsigned char*)p;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ b[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Write all 'n' bytes at 'p' to 'fd' (at 'off' if it isn't -1).
+inline bool
+write_all(int fd, const void *p, size_t n, off_t off = -1) {
+    const char *b = (const char*)p;
+    while (n > 0) {
+        ssize_t w = off < 0 ? write(fd, b, n) : pwrite(fd, b, n, off);
+        if (w <= 0) {
+            return false;
+        }
+        b += w;
+        n -= w;
+        off = off < 0 ? off : off + w;
+    }
+    return true;
+}
+
+// Sync the directory 'path' is in, so files created, renamed or
+// removed in it stay that way.
+inline bool
+sync_dir(const std::string &path) {
+    size_t s = path.rfind('/');
+    std::string dir = s == std::string::npos ? "." : s == 0 ? "/" : path.substr(0, s);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// The journal a checkpoint writes before changing the file: this
+// header, the offset and length of each page, the pages, and a hash
+// of all of that.
+struct pma_journal_header {
+    char magic[8];
+    int64_t npages;
+    int64_t seq;
+};
+
+// A PMA kept in a file (in the format of PMA::save()) that survives a
+// crash. Every insert and erase is first appended to an operation log
+// ('path'.log). checkpoint() brings the file up to date by writing
+// only the pages that hold the slots, bits, counts and index keys of
+// the chunks that changed since the last checkpoint (see
+// PMA::track_dirty), so its I/O follows the write rate rather than
+// the size of the PMA. A resize changes every chunk, so the
+// checkpoint after one writes a whole new file.
+//
+// A checkpoint writes its pages to a journal ('path'.journal) and
+// syncs it before writing them to the file, and writes the file's
+// header last, so a crash in the middle leaves either the old file
+// or a complete journal that open() applies. open() then replays the
+// log records after the file's 'seq', which rebuilds the PMA as it
+// was after the last logged operation. So change 'pma' only through
+// insert() and erase().
+template <typename Key = int, typename Compare = std::less<Key> >
+struct PersistentPMA {
+    typedef PMA<Key, Compare> pma_t;
+
+    // One logged operation. 'check' is a hash of the rest, so a
+    // record torn by a crash ends the log.
+    struct log_record {
+        int64_t seq;
+        int64_t op;
+        Key key;
+        uint64_t check;
+    };
+
+    pma_t pma;
+    std::string path;
+    int log_fd;
+    // Header of the file as of the last checkpoint
+    pma_file_header h;
+    // Number of operations logged
+    int64_t seq;
+    // Sync the log after every operation. Without it, logged
+    // operations survive the process crashing but not the machine.
+    bool sync_log;
+    // Set once an operation couldn't be logged; no more are done
+    bool failed;
+    // Bytes the last checkpoint wrote, counting the journal
+    int64_t checkpoint_bytes;
+
+    PersistentPMA(const Compare &c = Compare())
+        : pma(2, c), log_fd(-1), seq(0), sync_log(false), failed(false), checkpoint_bytes(0) {
+        static_assert(std::is_trivially_copyable<Key>::value, "the log holds the keys' bytes");
+        memset(&this->h, 0, sizeof(this->h));
+    }
+
+    ~PersistentPMA() {
+        this->close();
+    }
+
+    // Open the PMA at 'path', making it if there is none: apply a
+    // checkpoint's journal if one was left, load the file and replay
+    // the log. Returns false if the files can't be read or are
+    // corrupt.
+    bool
+    open(const char *path) {
+        this->close();
+        this->path = path;
+        this->failed = false;
+        if (!this->apply_journal()) {
+            return false;
+        }
+        bool exists = access(path, F_OK) == 0;
+        if (exists) {
+            MappedPMA<Key, Compare> m(this->pma.comp);
+            if (!m.open(path)) {
+                return false;
+            }
+            m.load_into(this->pma);
+            this->h = m.h;
+        } else {
+            this->pma = pma_t(2, this->pma.comp);
+            memset(&this->h, 0, sizeof(this->h));
+        }
+        this->seq = this->h.seq;
+        this->pma.set_track_dirty(true);
+        if (!this->replay()) {
+            return false;
+        }
+        return exists || this->checkpoint();
+    }
+
+    void
+    close() {
+        if (this->log_fd >= 0) {
+            ::close(this->log_fd);
+            this->log_fd = -1;
+        }
+    }
+
+    int
+    size() const {
+        return this->pma.size();
+    }
+
+    // Log and insert 'v'. Returns false (without inserting it) if it
+    // couldn't be logged.
+    bool
+    insert(const Key &v) {
+        if (!this->log(PMA_LOG_INSERT, v)) {
+            return false;
+        }
+        this->pma.insert(v);
+        return true;
+    }
+
+    // Log and erase 'v'. Returns whether it was there (false if it
+    // couldn't be logged; see 'failed').
+    bool
+    erase(const Key &v) {
+        return this->log(PMA_LOG_ERASE, v) && this->pma.erase(v);
+    }
+
+    // Bring the file up to date with every logged operation, and
+    // empty the log. Returns false on an I/O error, after which the
+    // file and the log still recover the PMA.
+    bool
+    checkpoint() {
+        pma_t &p = this->pma;
+        p.finish_resize();
+        std::string journal = this->path + ".journal";
+        vector<int64_t> pages;
+        if (!p.all_dirty && this->h.capacity == (int64_t)p.impl.size()) {
+            pages = this->dirty_pages();
+        }
+        bool ok;
+        // Once the journal and the pages come to more than the file,
+        // write a new file instead.
+        if (pages.empty() || 2 * (int64_t)pages.size() * PMA_FILE_ALIGN >= this->h.file_size) {
+            ok = p.save(this->path.c_str(), this->seq) && sync_dir(this->path);
+            this->checkpoint_bytes = p.file_header().file_size;
+            // A journal left by a checkpoint that failed is older than
+            // this file now
+            remove(journal.c_str());
+        } else {
+            ok = this->write_pages(pages);
+        }
+        if (!ok) {
+            return false;
+        }
+        this->h = p.file_header(this->seq);
+        p.clear_dirty();
+        return ftruncate(this->log_fd, 0) == 0;
+    }
+
+    // The pages of the file (in order) that changed since the last
+    // checkpoint: the header's, and those of the dirty chunks.
+    vector<int64_t>
+    dirty_pages() const {
+        const pma_t &p = this->pma;
+        const int64_t P = PMA_FILE_ALIGN;
+        const pma_file_header &nh = this->h;
+        int cs = p.chunk_size, n = p.nchunks;
+        vector<int64_t> pages(1, 0);
+        auto add = [&](int64_t off, int64_t bytes) {
+            for (int64_t q = off / P; q <= (off + bytes - 1) / P; ++q) {
+                pages.push_back(q);
+            }
+        };
+        for (int c = p.dirty.next(0, n); c < n; c = p.dirty.next(c + 1, n)) {
+            int64_t l = (int64_t)c * cs;
+            add(nh.impl_off + sizeof(Key) * l, sizeof(Key) * cs);
+            add(nh.present_off + sizeof(uint64_t) * (l / 64),
+                sizeof(uint64_t) * ((l + cs + 63) / 64 - l / 64));
+            for (int k = n + c; k > 0; k /= 2) {
+                add(nh.counts_off + sizeof(int) * k, sizeof(int));
+            }
+            add(nh.index_off + sizeof(Key) * (c == n - 1 ? n : p.index.node(c)), sizeof(Key));
+        }
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+        return pages;
+    }
+
+    // Write 'pages' of the file through the journal.
+    bool
+    write_pages(const vector<int64_t> &pages) {
+        pma_t &p = this->pma;
+        const int64_t P = PMA_FILE_ALIGN;
+        pma_file_header nh = p.file_header(this->seq);
+        int n = p.nchunks;
+
+        // Copy each page out of the arrays it overlaps.
+        struct section {
+            int64_t off, bytes;
+            const void *data;
+        } sections[] = {
+            { 0, sizeof(nh), &nh },
+            { nh.impl_off, (int64_t)sizeof(Key) * (int64_t)p.impl.size(), p.impl.data() },
+            { nh.present_off, (int64_t)sizeof(uint64_t) * (int64_t)p.present.words.size(),
+              p.present.words.data() },
+            { nh.counts_off, (int64_t)sizeof(int) * (int64_t)p.counts.cnt.size(),
+              p.counts.cnt.data() },
+            { nh.index_off, (int64_t)sizeof(Key) * n, p.index.key.data() },
+            { nh.index_off + (int64_t)sizeof(Key) * n, sizeof(Key), &p.index.last },
+        };
+        int np = pages.size();
+        // The offset and length of each page, then the pages
+        vector<int64_t> where(2 * np);
+        vector<char> buf(np * P);
+        for (int i = 0; i < np; ++i) {
+            int64_t a = pages[i] * P, b = std::min(a + P, nh.file_size);
+            where[2*i] = a;
+            where[2*i + 1] = b - a;
+            for (const section &s : sections) {
+                int64_t lo = std::max(a, s.off), hi = std::min(b, s.off + s.bytes);
+                if (lo < hi) {
+                    memcpy(&buf[i * P + lo - a], (const char*)s.data + lo - s.off, hi - lo);
+                }
+            }
+        }
+
+        pma_journal_header jh;
+        memset(&jh, 0, sizeof(jh));
+        memcpy(jh.magic, PMA_JOURNAL_MAGIC, sizeof(jh.magic));
+        jh.npages = np;
+        jh.seq = this->seq;
+        uint64_t check = fnv1a(&jh, sizeof(jh));
+        check = fnv1a(where.data(), sizeof(int64_t) * where.size(), check);
+        check = fnv1a(buf.data(), buf.size(), check);
+        std::string journal = this->path + ".journal";
+        int fd = ::open(journal.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = write_all(fd, &jh, sizeof(jh)) &&
+            write_all(fd, where.data(), sizeof(int64_t) * where.size()) &&
+            write_all(fd, buf.data(), buf.size()) &&
+            write_all(fd, &check, sizeof(check)) &&
+            fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        ok = ok && sync_dir(this->path) && this->apply_pages(where.data(), buf.data(), np);
+        ok = ok && remove(journal.c_str()) == 0;
+        this->checkpoint_bytes = 2 * buf.size() + sizeof(int64_t) * where.size();
+        return ok;
+    }
+
+    // Write 'np' pages (at where[2*i], of length where[2*i + 1]) into
+    // the file. The header is on page 0, and is written and synced
+    // after the rest: the file's 'seq' only moves on once the pages
+    // are there.
+    bool
+    apply_pages(const int64_t *where, const char *buf, int np) {
+        int fd = ::open(this->path.c_str(), O_WRONLY);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = true;
+        for (int i = np - 1; ok && i >= 0; --i) {
+            if (i == 0) {
+                ok = fsync(fd) == 0;
+            }
+            ok = ok && write_all(fd, buf + i * PMA_FILE_ALIGN, where[2*i + 1], where[2*i]);
+        }
+        ok = ok && fsync(fd) == 0;
+        return ::close(fd) == 0 && ok;
+    }
+
+    // If a checkpoint left a complete journal, and the file doesn't
+    // have it yet, write its pages into the file. Then remove it.
+    bool
+    apply_journal() {
+        std::string journal = this->path + ".journal";
+        FILE *f = fopen(journal.c_str(), "rb");
+        if (!f) {
+            return true;
+        }
+        vector<char> data;
+        char b[1 << 16];
+        size_t r;
+        while ((r = fread(b, 1, sizeof(b), f)) > 0) {
+            data.insert(data.end(), b, b + r);
+        }
+        fclose(f);
+
+        pma_journal_header jh;
+        memset(&jh, 0, sizeof(jh));
+        int64_t size = data.size();
+        bool complete = size >= (int64_t)(sizeof(jh) + sizeof(uint64_t));
+        if (complete) {
+            memcpy(&jh, data.data(), sizeof(jh));
+            complete = !memcmp(jh.magic, PMA_JOURNAL_MAGIC, sizeof(jh.magic)) &&
+                jh.npages > 0 && jh.npages < size / PMA_FILE_ALIGN + 1 &&
+                size == (int64_t)(sizeof(jh) + jh.npages * (2 * sizeof(int64_t) + PMA_FILE_ALIGN) +
+                                  sizeof(uint64_t));
+        }
+        if (complete) {
+            uint64_t check;
+            memcpy(&check, &data[size - sizeof(check)], sizeof(check));
+            complete = fnv1a(data.data(), size - sizeof(check)) == check;
+        }
+        pma_file_header fh;
+        int fd = ::open(this->path.c_str(), O_RDONLY);
+        bool newer = fd >= 0 && pread(fd, &fh, sizeof(fh), 0) == (ssize_t)sizeof(fh) &&
+            fh.seq < jh.seq;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (complete && newer) {
+            const int64_t *where = (const int64_t*)&data[sizeof(jh)];
+            const char *pages = (const char*)(where + 2 * jh.npages);
+            if (!this->apply_pages(where, pages, jh.npages)) {
+                return false;
+            }
+        }
+        return remove(journal.c_str()) == 0 && sync_dir(this->path);
+    }
+
+    // Open the log and redo the operations in it that the file
+    // doesn't have. A torn record at the end is cut off.
+    bool
+    replay() {
+        std::string log_path = this->path + ".log";
+        this->log_fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (this->log_fd < 0) {
+            return false;
+        }
+        FILE *f = fopen(log_path.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        log_record r;
+        off_t end = 0;
+        bool ok = true;
+        while (fread(&r, sizeof(r), 1, f) == 1 && r.check == check(r)) {
+            if (r.seq > this->seq) {
+                if (r.seq != this->seq + 1) {
+                    // Operations are missing
+                    ok = false;
+                    break;
+                }
+                if (r.op == PMA_LOG_INSERT) {
+                    this->pma.insert(r.key);
+                } else {
+                    this->pma.erase(r.key);
+                }
+                this->seq = r.seq;
+            }
+            end += sizeof(r);
+        }
+        fclose(f);
+        return ok && ftruncate(this->log_fd, end) == 0;
+    }
+
+    static uint64_t
+    check(const log_record &r) {
+        return fnv1a(&r, (const char*)&r.check - (const char*)&r);
+    }
+
+    // Append operation 'op' on 'v' to the log.
+    bool
+    log(int64_t op, const Key &v) {
+        if (this->failed) {
+            return false;
+        }
+        log_record r;
+        memset(&r, 0, sizeof(r));
+        r.seq = this->seq + 1;
+        r.op = op;
+        r.key = v;
+        r.check = check(r);
+        if (!write_all(this->log_fd, &r, sizeof(r)) ||
+            (this->sync_log && fdatasync(this->log_fd) != 0)) {
+            this->failed = true;
+            return false;
+        }
+        ++this->seq;
+        return true;
+    }
+};
+
+#endif // PERSISTENT_PMA_HPP
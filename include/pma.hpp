@@ -0,0 +1,1961 @@
+#if !defined PMA_HPP
+#define PMA_HPP
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <unistd.h>
+#include "arena.hpp"
+#include "pma_policy.hpp"
+#include "bitmap.hpp"
+#include "chunk_search.hpp"
+#include "range_scan.hpp"
+
+using namespace std;
+
+// #define dprintf(args...) printf(args)
+#define dprintf(args...)
+
+typedef vector<int, lazy_allocator<int> > vi_t;
+
+int log2(int n) {
+    int lg2 = 0;
+    while (n > 1) {
+        n /= 2;
+        ++lg2;
+    }
+    return lg2;
+}
+
+long long nmoves = 0;
+
+// Arrays smaller than this are resized in one go.
+#define MIN_INCREMENTAL_RESIZE 1024
+// Number of old chunks migrated per insert during an incremental
+// resize.
+#define MIGRATE_CHUNKS 2
+// Scans prefetch the slots this many chunks ahead.
+#define SCAN_PREFETCH_CHUNKS 4
+// Windows of at least this many slots are rebalanced, and arrays of
+// at least this many slots resized, by PMA::nthreads threads.
+#if !defined PARALLEL_REBALANCE_MIN
+#define PARALLEL_REBALANCE_MIN (1 << 20)
+#endif
+// In adaptive mode (see PMA::set_adaptive()), the share of a
+// rebalance's free slots placed where the recent inserts went; the
+// rest are spread evenly.
+#if !defined ADAPTIVE_SKEW
+#define ADAPTIVE_SKEW 0.75
+#endif
+
+// Run f(0), ..., f(n-1) on n threads (f(0) on this one).
+template <typename F>
+void
+parallel_for(int n, F f) {
+    vector<std::thread> threads;
+    for (int t = 1; t < n; ++t) {
+        threads.push_back(std::thread(f, t));
+    }
+    f(0);
+    for (int t = 1; t < n; ++t) {
+        threads[t - 1].join();
+    }
+}
+
+// The file PMA::save() writes (and MappedPMA maps): this header, then
+// 'impl' (capacity keys), 'present' (capacity/64 words), the counts
+// tree (2*nchunks ints) and the chunk index (nchunks keys, then the
+// last chunk's key), each at the page-aligned offset the header gives.
+// Everything is in native byte order. 'seq' is the number of logged
+// operations the file holds (see PersistentPMA), 0 if there is no log.
+#define PMA_FILE_MAGIC "PMAFILE"
+#define PMA_FILE_VERSION 2
+#define PMA_FILE_ALIGN 4096
+
+struct pma_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    int64_t capacity;
+    int64_t chunk_size;
+    int64_t nlevels;
+    int64_t nelems;
+    int64_t gap_free;
+    int64_t impl_off;
+    int64_t present_off;
+    int64_t counts_off;
+    int64_t index_off;
+    int64_t file_size;
+    int64_t seq;
+};
+
+// Number of elements in every window of the imaginary tree over the
+// chunks, stored as an implicit binary heap: the root is at 1, and
+// the window of level 'level' starting at chunk q<<level is at
+// (nleaves >> level) + q.
+struct counts_tree {
+    vi_t cnt;
+    int nleaves;
+
+    counts_tree()
+        : nleaves(0)
+    { }
+
+    void
+    init(int n) {
+        this->cnt.assign(2 * n, 0);
+        this->nleaves = n;
+    }
+
+    void
+    swap(counts_tree &rhs) {
+        this->cnt.swap(rhs.cnt);
+        std::swap(this->nleaves, rhs.nleaves);
+    }
+
+    int
+    at(int level, int q) const {
+        return this->cnt[(this->nleaves >> level) + q];
+    }
+
+    int
+    total() const {
+        return this->cnt[1];
+    }
+
+    // Add 'd' to chunk 'c' and every window above it.
+    void
+    add(int c, int d) {
+        for (int k = this->nleaves + c; k > 0; k /= 2) {
+            this->cnt[k] += d;
+        }
+    }
+
+    // Number of elements in chunks [0, c): the left siblings of the
+    // path from chunk c to the root cover them.
+    int
+    prefix(int c) const {
+        if (c >= this->nleaves) {
+            return this->total();
+        }
+        int s = 0;
+        for (int k = this->nleaves + c; k > 1; k /= 2) {
+            if (k & 1) {
+                s += this->cnt[k - 1];
+            }
+        }
+        return s;
+    }
+
+    // Recount the window of level 'level' starting at chunk q<<level
+    // (and everything below it) from 'present', and fix up the
+    // windows above it.
+    void
+    rebuild(const bitmap &present, int chunk_size, int level, int q) {
+        int old = this->at(level, q);
+        int l = this->nleaves + (q << level), r = l + (1 << level);
+        for (int k = l; k < r; ++k) {
+            int c = k - this->nleaves;
+            this->cnt[k] = present.count(c * chunk_size, (c + 1) * chunk_size);
+        }
+        this->update(level, q, old);
+    }
+
+    // Recompute the window of level 'level' starting at chunk q<<level
+    // (and the windows in it) from its leaves, which have just been
+    // set, and fix up the windows above it. 'old' is what it counted
+    // before.
+    void
+    update(int level, int q, int old) {
+        int l = this->nleaves + (q << level), r = l + (1 << level);
+        for (int i = 0; i < level; ++i) {
+            l /= 2;
+            r /= 2;
+            for (int k = l; k < r; ++k) {
+                this->cnt[k] = this->cnt[2*k] + this->cnt[2*k + 1];
+            }
+        }
+        int d = this->cnt[l] - old;
+        if (d) {
+            for (int k = l / 2; k > 0; k /= 2) {
+                this->cnt[k] += d;
+            }
+        }
+    }
+
+    // Check every window against 'present'.
+    bool
+    verify(const bitmap &present, int chunk_size) const {
+        for (int k = this->nleaves - 1; k > 0; --k) {
+            if (this->cnt[k] != this->cnt[2*k] + this->cnt[2*k + 1]) {
+                return false;
+            }
+        }
+        for (int c = 0; c < this->nleaves; ++c) {
+            if (this->cnt[this->nleaves + c] !=
+                present.count(c * chunk_size, (c + 1) * chunk_size)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// A search index over the largest key of each chunk. An empty chunk
+// takes the key of the chunk before it (leading empty chunks take the
+// key of the first chunk with an element), so the keys are sorted.
+// The keys of the first n-1 chunks form a complete binary tree stored
+// in Eytzinger (BFS) order, so a search descends through a few cache
+// lines of 'key' instead of probing chunks of the array; the last
+// chunk's key is kept aside.
+template <typename Key, typename Compare = std::less<Key> >
+struct chunk_index {
+    vector<Key, lazy_allocator<Key> > key;
+    Key last;
+    int n;
+    int m;  // Height of the tree, i.e. log2(n)
+    Compare comp;
+
+    chunk_index(const Compare &c = Compare())
+        : last(), n(0), m(0), comp(c)
+    { }
+
+    void
+    init(int nchunks) {
+        this->n = nchunks;
+        this->m = log2(nchunks);
+        this->key.assign(nchunks, Key());
+        this->last = Key();
+    }
+
+    void
+    swap(chunk_index &rhs) {
+        this->key.swap(rhs.key);
+        std::swap(this->last, rhs.last);
+        std::swap(this->n, rhs.n);
+        std::swap(this->m, rhs.m);
+    }
+
+    // Position in 'key' of chunk 'c' < n-1. Chunk c is the (c+1)'th
+    // node in order, and in-order positions with t trailing zeros are
+    // the nodes t levels above the leaves.
+    int
+    node(int c) const {
+        int p = c + 1;
+        int t = __builtin_ctz(p);
+        return (1 << (this->m - 1 - t)) + (p >> (t + 1));
+    }
+
+    int
+    chunk(int k) const {
+        return chunk(k, this->m);
+    }
+
+    static int
+    chunk(int k, int m) {
+        int d = 31 - __builtin_clz(k);
+        return ((2 * (k - (1 << d)) + 1) << (m - 1 - d)) - 1;
+    }
+
+    const Key&
+    get(int c) const {
+        return c == this->n - 1 ? this->last : this->key[this->node(c)];
+    }
+
+    void
+    set(int c, const Key &k) {
+        if (c == this->n - 1) {
+            this->last = k;
+        } else {
+            this->key[this->node(c)] = k;
+        }
+    }
+
+    // The first chunk whose key is >= 'v', or n if there is none.
+    int
+    search(const Key &v) const {
+        return search(this->key.data(), this->n, this->m, this->last, v, this->comp);
+    }
+
+    // search() over the keys 'key' of an index of 'n' chunks (see
+    // ConcurrentPMA, which searches a snapshot of them).
+    static int
+    search(const Key *key, int n, int m, const Key &last, const Key &v, const Compare &comp) {
+        int k = 1;
+        while (k < n) {
+            // The 16 keys 4 levels down are contiguous (a cache line
+            // of 4-byte keys).
+            __builtin_prefetch(key + 16 * k);
+            k = 2 * k + comp(key[k], v);
+        }
+        // Undo the right turns after the last left turn.
+        k >>= __builtin_ffs(~k);
+        if (k) {
+            return chunk(k, m);
+        }
+        return !comp(last, v) ? n - 1 : n;
+    }
+};
+
+// The values of a PMA that only has keys: a column of empty values
+// with the few vector operations PMA uses, all of which compile away.
+struct no_values {
+    struct value_type { };
+    typedef int iterator;
+
+    value_type&
+    operator[](int) {
+        static value_type v;
+        return v;
+    }
+
+    iterator
+    begin() {
+        return 0;
+    }
+
+    void resize(int) { }
+    void reserve(int) { }
+    void clear() { }
+    void swap(no_values &) { }
+    void push_back(const value_type &) { }
+    void insert(iterator, const value_type &) { }
+};
+
+// A PMA of keys ordered by 'Compare'. Arithmetic keys compared with
+// std::less or std::greater search chunks with the SIMD kernels in
+// chunk_search.hpp; any other key (say, a (tenant, timestamp) pair)
+// falls back to calling 'comp' slot by slot.
+//
+// 'Values' is a column of values kept in a separate array parallel to
+// 'impl' (see PMAMap in pma_map.hpp): every element move moves its
+// value along, but searches only touch the keys.
+//
+// 'Density' gives the density thresholds and growth factor, and
+// 'Geometry' the chunk size (see pma_policy.hpp).
+template <typename Key = int, typename Compare = std::less<Key>,
+          typename Alloc = arena_allocator<Key>, typename Values = no_values,
+          typename Density = default_density, typename Geometry = default_geometry>
+struct PMA {
+    typedef vector<Key, Alloc> keys_t;
+    typedef typename Values::value_type mapped_type;
+
+    keys_t impl;
+    Values vals;
+    int nelems;
+    bitmap present;
+    // Number of elements in each window (see count_interval())
+    counts_tree counts;
+    // Largest key in each chunk (see lower_bound())
+    chunk_index<Key, Compare> index;
+    Compare comp;
+    // In gap-free mode (see set_gap_free()) every empty slot of 'impl'
+    // holds the key of the closest element before it (of the first
+    // element if there is none), so 'impl' is sorted.
+    bool gap_free;
+    int chunk_size;
+    int nchunks;
+    int nlevels;
+    // Density thresholds of each level as element counts, for the
+    // current capacity
+    density_limits limits;
+    keys_t tmp;
+    Values vtmp;
+    // Threads to spread large windows with (see PARALLEL_REBALANCE_MIN)
+    int nthreads;
+    // If 'track_dirty' is set, the chunks whose slots, counts or index
+    // key changed since clear_dirty() are set in 'dirty', or
+    // 'all_dirty' is set if the array has been resized since (see
+    // PersistentPMA).
+    bool track_dirty;
+    bool all_dirty;
+    bitmap dirty;
+    // In adaptive mode (see set_adaptive()), the number of inserts
+    // that landed in each chunk, halved whenever it is rebalanced, and
+    // scratch space for sharing a window's elements among its chunks.
+    bool adaptive;
+    vector<int> heat;
+    vector<long long> heat_sum;
+    vector<int> quota;
+
+    // State of an incremental resize (see start_resize()). Old chunk
+    // 'j' is either still in 'old_impl', or has been spread over the
+    // migrate_span() slots from j*migrate_span() of 'impl'.
+    keys_t old_impl;
+    Values old_vals;
+    bitmap old_present;
+    vector<bool> migrated;
+    int old_chunk_size;
+    int old_nchunks;
+    // Old chunks before 'next_migrate' have all been migrated
+    int next_migrate;
+    int nunmigrated;
+
+    // Visits the elements in order. The iterator keeps the bits of
+    // 'present' from slot 'i' to the end of its word, so moving to the
+    // next element in the same word doesn't touch the bitmap. Moving
+    // to another word skips empty slots a word at a time and
+    // prefetches the slots SCAN_PREFETCH_CHUNKS chunks ahead.
+    struct PMAIterator {
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef Key value_type;
+        typedef int difference_type;
+        typedef Key* pointer;
+        typedef Key& reference;
+
+        PMA *pma;
+        int i;
+        uint64_t bits;
+
+        PMAIterator(PMA *p, int _i)
+            : pma(p), i(_i) {
+            this->load_bits();
+        }
+
+        PMAIterator(const PMAIterator &rhs) {
+            this->pma  = rhs.pma;
+            this->i    = rhs.i;
+            this->bits = rhs.bits;
+        }
+
+        PMAIterator&
+        operator=(const PMAIterator &rhs) {
+            this->pma  = rhs.pma;
+            this->i    = rhs.i;
+            this->bits = rhs.bits;
+            return *this;
+        }
+
+        void
+        load_bits() {
+            this->bits = this->i < (int)pma->impl.size()
+                ? pma->present.words[this->i >> 6] & ~bitmap::mask_below(this->i & 63)
+                : 0;
+        }
+
+        PMAIterator&
+        operator++() {
+            int n = pma->impl.size();
+            if (i >= n) {
+                return *this;
+            }
+            this->bits &= this->bits - 1;
+            if (this->bits) {
+                i = (i & ~63) + __builtin_ctzll(this->bits);
+                return *this;
+            }
+            i = pma->present.next((i | 63) + 1, n);
+            pma->prefetch_ahead(i);
+            this->load_bits();
+            return *this;
+        }
+
+        PMAIterator
+        operator++(int) {
+            PMAIterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        // From end(), this goes to the last element.
+        PMAIterator&
+        operator--() {
+            i = pma->present.prev(0, i);
+            this->load_bits();
+            return *this;
+        }
+
+        PMAIterator
+        operator--(int) {
+            PMAIterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+
+        bool
+        operator==(const PMAIterator &rhs) const {
+            return this->pma == rhs.pma && this->i == rhs.i;
+        }
+
+        bool
+        operator!=(const PMAIterator &rhs) const {
+            return !(*this == rhs);
+        }
+
+        Key&
+        operator*() {
+            assert(pma->present[this->i]);
+            return pma->impl[this->i];
+        }
+
+        Key*
+        operator->() {
+            assert(pma->present[this->i]);
+            return &(pma->impl[this->i]);
+        }
+    };
+
+    typedef PMAIterator iterator;
+
+    // The elements in [lo, hi), see range().
+    struct PMARange {
+        iterator first, last;
+
+        PMARange(iterator f, iterator l)
+            : first(f), last(l)
+        { }
+
+        iterator
+        begin() const {
+            return this->first;
+        }
+
+        iterator
+        end() const {
+            return this->last;
+        }
+    };
+
+    PMA(int capacity = 2, const Compare &c = Compare())
+        : nelems(0), index(c), comp(c), gap_free(false),
+          nthreads(std::max(1, (int)std::thread::hardware_concurrency())),
+          track_dirty(false), all_dirty(true), adaptive(false), nunmigrated(0) {
+        assert(capacity > 1);
+        assert(1 << log2(capacity) == capacity);
+
+        this->init_vars(capacity);
+        this->impl.resize(capacity);
+        this->vals.resize(capacity);
+        this->present.resize(capacity);
+        this->counts.init(this->nchunks);
+        this->index.init(this->nchunks);
+    }
+
+    // Bulk-load the keys in [first, last) in O(n). The keys are sorted
+    // first if they aren't already, and are spread evenly over the
+    // smallest array that is at most half full.
+    template <typename Iter>
+    PMA(Iter first, Iter last, const Compare &c = Compare())
+        : nelems(0), index(c), comp(c), gap_free(false),
+          nthreads(std::max(1, (int)std::thread::hardware_concurrency())),
+          track_dirty(false), all_dirty(true), adaptive(false), nunmigrated(0) {
+        if (!std::is_sorted(first, last, this->comp)) {
+            keys_t keys(first, last);
+            std::sort(keys.begin(), keys.end(), this->comp);
+            this->load(keys.begin(), keys.end());
+        } else {
+            this->load(first, last);
+        }
+    }
+
+    template <typename Iter>
+    void
+    load(Iter first, Iter last) {
+        int n = std::distance(first, last);
+        int capacity = 2;
+        while (capacity < 2 * n) {
+            capacity *= 2;
+        }
+
+        this->init_vars(capacity);
+        this->impl.resize(capacity);
+        this->vals.resize(capacity);
+        this->present.resize(capacity);
+        double d = (double)capacity / n;
+        for (int i = 0; i < n; ++i, ++first) {
+            int idx = d*i;
+            this->present.set(idx);
+            this->impl[idx] = *first;
+        }
+        this->nelems = n;
+        this->rebuild_counts();
+        this->rebuild_index();
+        this->fill_gaps(0, capacity);
+        nmoves += capacity;
+    }
+
+
+    double
+    upper_threshold_at(int level) const {
+        assert(level <= this->nlevels);
+        return Density::upper(level, this->nlevels);
+    }
+
+    // With the default policy, lower density thresholds go from 0.125
+    // at the leaves up to 0.25 at the root, which keeps the array
+    // within 2x of its live size while leaving room for hysteresis
+    // against the upper threshold at the root (0.5).
+    double
+    lower_threshold_at(int level) const {
+        assert(level <= this->nlevels);
+        return Density::lower(level, this->nlevels);
+    }
+
+    // Most elements the window of level 'level' may hold and be within
+    // its upper threshold.
+    int
+    max_elems_at(int level) const {
+        assert(level <= this->nlevels);
+        return this->limits.max[level];
+    }
+
+    // Fewest elements it may hold and be within its lower threshold.
+    int
+    min_elems_at(int level) const {
+        assert(level <= this->nlevels);
+        return this->limits.min[level];
+    }
+
+    static int
+    chunk_size_for(int capacity) {
+        return Geometry::template chunk_size<Key>(capacity);
+    }
+
+    void
+    init_vars(int capacity) {
+        this->chunk_size = chunk_size_for(capacity);
+        assert(this->chunk_size == (1 << log2(this->chunk_size)));
+        this->nchunks = capacity / this->chunk_size;
+        this->nlevels = log2(this->nchunks);
+        this->limits.template init<Density>(this->chunk_size, this->nlevels);
+        this->all_dirty = true;
+        if (this->adaptive) {
+            this->heat.assign(this->nchunks, 0);
+        }
+        dprintf("init_vars::capacity: %d, nelems: %d, chunk_size: %d, nchunks: %d\n", capacity, nelems, chunk_size, nchunks);
+    }
+
+    int
+    left_interval_boundary(int i, int interval_size) {
+        assert(interval_size == (1 << log2(interval_size)));
+        assert(i < (int)this->impl.size());
+
+        int q = i / interval_size;
+        int boundary = q * interval_size;
+        dprintf("left_interval_boundary(%d, %d) = %d\n", i, interval_size, boundary);
+        return boundary;
+    }
+
+    void
+    resize(int capacity) {
+        assert(capacity > 1);
+        assert(capacity >= this->nelems);
+        assert(1 << log2(capacity) == capacity);
+
+        keys_t tmpi(capacity);
+        Values tmpv;
+        tmpv.resize(capacity);
+        bitmap tmpp(capacity);
+        this->spread_into(tmpi, tmpv, tmpp, capacity);
+        this->impl.swap(tmpi);
+        this->vals.swap(tmpv);
+        this->present.swap(tmpp);
+        this->init_vars(capacity);
+        this->rebuild_counts();
+        this->rebuild_index();
+        this->fill_gaps(0, capacity);
+        nmoves += this->impl.size();
+        if ((int)this->tmp.capacity() > capacity) {
+            keys_t().swap(this->tmp);
+            Values().swap(this->vtmp);
+        }
+        // dprintf("After resize: ");
+        // this->print();
+    }
+
+    // Spread the elements evenly over the (empty) arrays 'ni', 'nv'
+    // and 'np' of 'capacity' slots. With several threads, each takes a
+    // piece of the array, reads the number of elements before it off
+    // the counts tree, and so knows where its elements go; bitmap
+    // words that two threads write to are or-ed atomically.
+    void
+    spread_into(keys_t &ni, Values &nv, bitmap &np, int capacity) {
+        double d = (double)capacity / this->nelems;
+        int n = this->impl.size();
+        int nt = this->threads_for(std::max(n, capacity));
+        if (nt == 1) {
+            int ctr = 0;
+            for (int i = this->present.next(0, n); i < n; i = this->present.next(i + 1, n)) {
+                int idx = d*(ctr++);
+                np.set(idx);
+                ni[idx] = this->impl[i];
+                nv[idx] = this->vals[i];
+            }
+            return;
+        }
+        parallel_for(nt, [&](int t) {
+                int l = this->piece(0, n, t, nt), e = this->piece(0, n, t + 1, nt);
+                int ctr = this->counts.prefix(l / this->chunk_size);
+                int w = 0;
+                uint64_t bits = 0;
+                for (int i = this->present.next(l, e); i < e; i = this->present.next(i + 1, e)) {
+                    int idx = d*(ctr++);
+                    if (idx >> 6 != w) {
+                        if (bits) {
+                            __atomic_fetch_or(&np.words[w], bits, __ATOMIC_RELAXED);
+                        }
+                        w = idx >> 6;
+                        bits = 0;
+                    }
+                    bits |= (uint64_t)1 << (idx & 63);
+                    ni[idx] = this->impl[i];
+                    nv[idx] = this->vals[i];
+                }
+                if (bits) {
+                    __atomic_fetch_or(&np.words[w], bits, __ATOMIC_RELAXED);
+                }
+            });
+    }
+
+    // Number of threads to spread 'w' slots with.
+    int
+    threads_for(int w) const {
+        return w >= PARALLEL_REBALANCE_MIN ? this->nthreads : 1;
+    }
+
+    // Start of the t'th of n pieces of [l, e), which start on a chunk
+    // and a bitmap word.
+    int
+    piece(int l, int e, int t, int n) const {
+        if (t == n) {
+            return e;
+        }
+        int a = std::max(64, this->chunk_size);
+        return l + (int)((long long)((e - l) / a) * t / n) * a;
+    }
+
+    // Like tests/dvector.hpp's deamortized_vector: allocate the new
+    // array, but move the old chunks over MIGRATE_CHUNKS at a time on
+    // every subsequent insert. Any window of the new array is
+    // migrated before it is used, and lower_bound() searches the old
+    // chunks in whichever array they currently live.
+    void
+    start_resize(int capacity) {
+        assert(!this->migrating());
+        assert(capacity == Density::growth * (int)this->impl.size());
+        dprintf("start_resize(%d)\n", capacity);
+
+        this->old_chunk_size = this->chunk_size;
+        this->old_nchunks = this->nchunks;
+        this->old_impl.swap(this->impl);
+        this->old_vals.swap(this->vals);
+        this->old_present.swap(this->present);
+        keys_t(capacity).swap(this->impl);
+        this->vals.resize(capacity);
+        bitmap(capacity).swap(this->present);
+        this->migrated.assign(this->old_nchunks, false);
+        this->next_migrate = 0;
+        this->nunmigrated = this->old_nchunks;
+        this->init_vars(capacity);
+        this->counts.init(this->nchunks);
+        this->index.init(this->nchunks);
+    }
+
+    bool
+    migrating() const {
+        return this->nunmigrated > 0;
+    }
+
+    // Number of slots of 'impl' an old chunk is spread over.
+    int
+    migrate_span() const {
+        return Density::growth * this->old_chunk_size;
+    }
+
+    // Spread the elements of old chunk 'j' evenly over its
+    // migrate_span() slots in 'impl'. With the default growth of 2, an
+    // old chunk with at least 2 elements leaves neither half of its
+    // new slots empty.
+    void
+    migrate_chunk(int j) {
+        if (this->migrated[j]) {
+            return;
+        }
+        int l = j * this->old_chunk_size;
+        int e = l + this->old_chunk_size;
+        tmp.clear();
+        vtmp.clear();
+        for (int i = this->old_present.next(l, e); i < e; i = this->old_present.next(i + 1, e)) {
+            tmp.push_back(this->old_impl[i]);
+            vtmp.push_back(this->old_vals[i]);
+        }
+        int left = Density::growth * l;
+        double m = (double)this->migrate_span() / tmp.size();
+        for (int i = 0; i < (int)tmp.size(); ++i) {
+            int k = i * m + left;
+            this->present.set(k);
+            this->impl[k] = tmp[i];
+            this->vals[k] = vtmp[i];
+        }
+        int first = left / this->chunk_size;
+        int last = (left + this->migrate_span()) / this->chunk_size;
+        for (int c = first; c < last; ++c) {
+            this->counts.rebuild(this->present, this->chunk_size, 0, c);
+        }
+        this->migrated[j] = true;
+        this->refresh_index(first, last);
+        nmoves += this->migrate_span();
+
+        if (--this->nunmigrated == 0) {
+            keys_t().swap(this->old_impl);
+            Values().swap(this->old_vals);
+            bitmap().swap(this->old_present);
+            vector<bool>().swap(this->migrated);
+        }
+    }
+
+    void
+    migrate_step() {
+        for (int c = 0; c < MIGRATE_CHUNKS && this->migrating(); ++c) {
+            while (this->migrated[this->next_migrate]) {
+                ++this->next_migrate;
+            }
+            this->migrate_chunk(this->next_migrate);
+        }
+    }
+
+    // Make sure that the window [left, left+w) of 'impl' holds no
+    // unmigrated elements.
+    void
+    migrate_window(int left, int w) {
+        if (!this->migrating()) {
+            return;
+        }
+        int r = this->migrate_span();
+        // The last migration frees 'migrated', so stop there.
+        for (int j = left / r; j * r < left + w && this->migrating(); ++j) {
+            this->migrate_chunk(j);
+        }
+    }
+
+    void
+    finish_resize() {
+        while (this->migrating()) {
+            this->migrate_step();
+        }
+    }
+
+    // Number of elements in the window of level 'level' starting at
+    // 'left'. This is O(1): we read it off the counts tree.
+    int
+    count_interval(int left, int level) {
+        return this->counts.at(level, left / (this->chunk_size << level));
+    }
+
+    // Recount the whole counts tree from 'present'.
+    void
+    rebuild_counts() {
+        this->counts.init(this->nchunks);
+        this->counts.rebuild(this->present, this->chunk_size, this->nlevels, 0);
+    }
+
+    // Whether new chunk 'c' holds its elements, i.e. isn't waiting
+    // for an old chunk to be migrated into it.
+    bool
+    chunk_migrated(int c) const {
+        return !this->migrating() ||
+            this->migrated[c * this->chunk_size / this->migrate_span()];
+    }
+
+    // Recompute the index keys of chunks [first, last), and of the
+    // (migrated) empty chunks after them that carry their key. If
+    // there are no elements before 'first', the leading empty chunks
+    // get the key of the first chunk we find with an element.
+    void
+    refresh_index(int first, int last) {
+        bool leading = first == 0 || (this->counts.at(0, 0) == 0 &&
+                                      this->present.prev(0, first * this->chunk_size) < 0);
+        Key k = leading ? Key() : this->index.get(first - 1);
+        for (int c = first; c < this->nchunks; ++c) {
+            int i = this->present.prev(c * this->chunk_size, (c + 1) * this->chunk_size);
+            if (c >= last && (i >= 0 || !this->chunk_migrated(c))) {
+                break;
+            }
+            if (i >= 0) {
+                k = this->impl[i];
+                if (leading) {
+                    for (int b = 0; b < c; ++b) {
+                        this->index.set(b, k);
+                        this->touch(b);
+                    }
+                    leading = false;
+                }
+            }
+            this->index.set(c, k);
+            this->touch(c);
+        }
+    }
+
+    // Mark chunk 'c' as changed. Everything that changes the slots or
+    // counts of a chunk refreshes its index key too, so
+    // refresh_index() marks them all (and fill_gaps() the chunks it
+    // fills past the window).
+    void
+    touch(int c) {
+        if (this->track_dirty && !this->all_dirty) {
+            this->dirty.set(c);
+        }
+    }
+
+    // Start or stop tracking the chunks that change. Either way, no
+    // chunk is dirty after this.
+    void
+    set_track_dirty(bool on) {
+        this->track_dirty = on;
+        this->clear_dirty();
+    }
+
+    void
+    clear_dirty() {
+        assert(!this->migrating());
+        bitmap(this->track_dirty ? this->nchunks : 0).swap(this->dirty);
+        this->all_dirty = false;
+    }
+
+    void
+    rebuild_index() {
+        this->index.init(this->nchunks);
+        this->refresh_index(0, this->nchunks);
+    }
+
+    // Debug check of 'counts', 'index' and 'nelems' against 'present'.
+    bool
+    verify_counts() const {
+        if (!this->counts.verify(this->present, this->chunk_size)) {
+            return false;
+        }
+        if (this->migrating()) {
+            return true;
+        }
+        int first = this->present.next(0, this->impl.size());
+        if (first < (int)this->impl.size()) {
+            int c = first / this->chunk_size;
+            Key k = this->impl[this->present.prev(first, (c + 1) * this->chunk_size)];
+            for (c = 0; c < this->nchunks; ++c) {
+                int i = this->present.prev(c * this->chunk_size, (c + 1) * this->chunk_size);
+                if (i >= 0) {
+                    k = this->impl[i];
+                }
+                if (this->comp(this->index.get(c), k) || this->comp(k, this->index.get(c))) {
+                    return false;
+                }
+            }
+        }
+        return this->counts.total() == this->nelems;
+    }
+
+    void
+    get_interval_stats(int left, int level, bool &in_limit, int &sz) {
+        sz = count_interval(left, level);
+        dprintf("sz: %d, max: %d\n", sz, max_elems_at(level));
+        in_limit = sz + 1 <= this->max_elems_at(level);
+    }
+
+    // Like get_interval_stats(), but checks the lower threshold. The
+    // window must also have at least one element per chunk, since
+    // lower_bound() depends on it.
+    void
+    get_interval_lower_stats(int left, int level, bool &in_limit, int &sz) {
+        sz = count_interval(left, level);
+        dprintf("sz: %d, min: %d\n", sz, min_elems_at(level));
+        in_limit = sz >= this->min_elems_at(level) && sz >= (1 << level);
+    }
+
+    int
+    lb_in_chunk(int l, const Key &v) {
+        int e = l + this->chunk_size;
+        if (this->gap_free) {
+            // An empty slot >= v has an element with the same key
+            // before it (or, before the first element, after it), so
+            // the first slot >= v is an element unless that element
+            // is outside the chunk. Then the slot is 'l' and every
+            // element after it is >= v.
+            int i = first_ge_sorted(this->impl.data(), l, e, v, this->comp);
+            return i > l || i == e || this->present[i] ? i : this->present.next(i, e);
+        }
+        return first_present_ge(this->impl.data(), this->present, l, e, v, this->comp);
+    }
+
+    int
+    lower_bound(const Key &v) {
+        int i;
+        if (this->nelems == 0) {
+            i = this->impl.size();
+        } else if (this->migrating()) {
+            i = this->lower_bound_migrating(v);
+        } else {
+#if 0
+            for (i = 0; i < this->impl.size(); ++i) {
+                if (this->present[i] && !this->comp(this->impl[i], v)) {
+                    break;
+                }
+            }
+#else
+            // An empty chunk has the same key as the chunk before it,
+            // so it is only found if every chunk before it is empty.
+            // Then we skip to the first chunk with an element.
+            int c = this->index.search(v);
+            while (c < this->nchunks && this->counts.at(0, c) == 0) {
+                ++c;
+            }
+            i = c * this->chunk_size;
+#endif
+        }
+        dprintf("lower_bound() == %d\n", i);
+        return i;
+    }
+
+    // Binary search for the first of 'n' chunks with an element >=
+    // 'v'. probe(m) returns -1 if chunk 'm' is empty, 0 if all its
+    // elements are < 'v', and 1 otherwise. Returns 'n' if there is no
+    // such chunk.
+    template <typename Probe>
+    int
+    search_chunks(int n, Probe probe) {
+        int l = 0, h = n, ans = n;
+        while (l < h) {
+            int m = l + (h-l)/2;
+            int k = m, r = -1;
+            while (k < h && (r = probe(k)) < 0) {
+                ++k;
+            }
+            if (k == h) {
+                // Chunks [m, h) are all empty
+                h = m;
+            } else if (r > 0) {
+                ans = k;
+                h = m;
+            } else {
+                l = k + 1;
+            }
+        }
+        return ans;
+    }
+
+    int
+    probe_chunk(int m, const Key &v) {
+        int l = m * this->chunk_size, e = l + this->chunk_size;
+        int i = this->present.prev(l, e);
+        if (i < 0) {
+            return -1;
+        }
+        // The chunk is sorted, so its last element decides.
+        return this->comp(this->impl[i], v) ? 0 : 1;
+    }
+
+    // probe_chunk() for old chunk 'j', wherever it currently lives.
+    int
+    probe_old_chunk(int j, const Key &v) {
+        if (this->migrated[j]) {
+            int l = j * this->migrate_span();
+            int i = this->present.prev(l, l + this->migrate_span());
+            return i < 0 ? -1 : (this->comp(this->impl[i], v) ? 0 : 1);
+        }
+        int l = j * this->old_chunk_size;
+        int i = this->old_present.prev(l, l + this->old_chunk_size);
+        return i < 0 ? -1 : (this->comp(this->old_impl[i], v) ? 0 : 1);
+    }
+
+    // lower_bound() over the old chunks while a resize is in
+    // progress. The old chunk we find is migrated, so that the index
+    // we return is into 'impl'.
+    int
+    lower_bound_migrating(const Key &v) {
+        int l = this->search_chunks(this->old_nchunks, [&](int j) {
+                return this->probe_old_chunk(j, v);
+            });
+        if (l == this->old_nchunks) {
+            return this->impl.size();
+        }
+        this->migrate_chunk(l);
+        int i = l * this->migrate_span();
+        int e = i + this->migrate_span();
+        while (i + this->chunk_size < e &&
+               this->lb_in_chunk(i, v) == i + this->chunk_size) {
+            i += this->chunk_size;
+        }
+        return i;
+    }
+
+    // Rebalance the window [left, left + w) in place, merging in 'v'
+    // (with value 'x') if it isn't NULL. The elements are packed
+    // against the right end of the window, then moved, left to right,
+    // to slot left + i*w/n for the n elements (in adaptive mode, to
+    // their share of each chunk), or to slot left + i if 'pack'. No
+    // element moves right of where it was packed, so none is
+    // overwritten before it has moved. Returns n.
+    int
+    spread_in_place(int left, int w, bool pack, const Key *v, const mapped_type &x) {
+        int e = left + w, s = e;
+        for (int i = this->present.prev(left, e); i >= 0; i = this->present.prev(left, i)) {
+            if (--s != i) {
+                this->impl[s] = this->impl[i];
+                this->vals[s] = this->vals[i];
+            }
+        }
+        this->present.clear(left, e);
+        int n = e - s + (v != NULL);
+        int r = n;
+        if (v) {
+            r = std::lower_bound(this->impl.begin() + s, this->impl.begin() + e, *v, this->comp) -
+                (this->impl.begin() + s);
+        }
+        assert(n <= w);
+        bool adapt = this->adaptive && !pack;
+        if (adapt) {
+            this->plan_quota(left, w, n);
+        }
+        // The chunk of the window the adaptive spread is filling, and
+        // the elements it has put in it
+        int c = 0, cn = 0;
+        for (int i = 0; i < n; ++i) {
+            int k;
+            if (pack) {
+                k = left + i;
+            } else if (adapt) {
+                while (cn == this->quota[c]) {
+                    ++c;
+                    cn = 0;
+                }
+                k = this->spread_slot(cn++, this->quota[c], left + c * this->chunk_size,
+                                      this->chunk_size);
+            } else {
+                k = this->spread_slot(i, n, left, w);
+            }
+            this->present.set(k);
+            if (i == r) {
+                this->impl[k] = *v;
+                this->vals[k] = x;
+                continue;
+            }
+            int j = s + i - (i > r);
+            assert(k <= j);
+            if (k != j) {
+                this->impl[k] = this->impl[j];
+                this->vals[k] = this->vals[j];
+            }
+        }
+        return n;
+    }
+
+    // Switch adaptive mode on or off. It follows Bender and Hu's
+    // adaptive PMA: every insert counts towards the chunk it lands in,
+    // and a rebalance gives the halves of each window free slots in
+    // proportion to their counts (within their density thresholds),
+    // so a region that keeps getting inserts keeps getting room, and
+    // a run of inserts into one spot doesn't refill it right away.
+    void
+    set_adaptive(bool on) {
+        this->adaptive = on;
+        this->heat.assign(on ? this->nchunks : 0, 0);
+    }
+
+    // Share the 'n' elements of the window [left, left + w) among its
+    // chunks (in 'quota'), and halve the chunks' insert counts.
+    void
+    plan_quota(int left, int w, int n) {
+        int c0 = left / this->chunk_size, m = w / this->chunk_size;
+        if ((int)this->quota.size() < m) {
+            this->quota.resize(m);
+            this->heat_sum.resize(m + 1);
+        }
+        this->heat_sum[0] = 0;
+        for (int c = 0; c < m; ++c) {
+            this->heat_sum[c + 1] = this->heat_sum[c] + this->heat[c0 + c];
+            this->heat[c0 + c] /= 2;
+        }
+        this->split_quota(0, log2(m), n);
+    }
+
+    // Split 'n' elements between the halves of the window of level
+    // 'level' made of the chunks from 'c' of the one plan_quota() is
+    // sharing out, and on down to its chunks.
+    void
+    split_quota(int c, int level, int n) {
+        if (level == 0) {
+            this->quota[c] = n;
+            return;
+        }
+        int half = 1 << (level - 1);
+        int cap = half * this->chunk_size;
+        long long hl = this->heat_sum[c + half] - this->heat_sum[c];
+        long long hr = this->heat_sum[c + 2 * half] - this->heat_sum[c + half];
+        // Share of the free slots that goes to the left half
+        double f = 0.5;
+        if (hl + hr > 0) {
+            f = 0.5 * (1.0 - ADAPTIVE_SKEW) + ADAPTIVE_SKEW * hl / (double)(hl + hr);
+        }
+        int nl = cap - (int)(f * (2 * cap - n));
+        // Neither half may end up above its upper threshold, or (if
+        // there are enough elements) below its lower threshold or with
+        // an empty chunk.
+        int hi = this->max_elems_at(level - 1);
+        int lo = std::max(half, this->min_elems_at(level - 1));
+        lo = std::min(lo, n / 2);
+        int a = std::max(lo, n - hi), b = std::min(hi, n - lo);
+        nl = a <= b ? std::min(std::max(nl, a), b) : n / 2;
+        this->split_quota(c, level - 1, nl);
+        this->split_quota(c + half, level - 1, n - nl);
+    }
+
+    void
+    insert_merge(int l, const Key &v, const mapped_type &x = mapped_type()) {
+        dprintf("insert_merge(%d)\n", l);
+        // Insert by packing the elements of a window of size
+        // 'chunk_size' to its left, with 'v' among them
+        this->spread_in_place(l, this->chunk_size, true, &v, x);
+        this->counts.add(l / this->chunk_size, 1);
+        this->refresh_index(l / this->chunk_size, l / this->chunk_size + 1);
+        this->fill_gaps(l, l + this->chunk_size);
+        ++this->nelems;
+        nmoves += chunk_size;
+    }
+
+    void
+    rebalance_interval(int left, int level) {
+        dprintf("rebalance_interval(%d, %d)\n", left, level);
+        int w = (1 << level) * this->chunk_size;
+        int e = left + w;
+        int nt = this->threads_for(w);
+        if (nt == 1) {
+            this->spread_in_place(left, w, false, NULL, mapped_type());
+            this->finish_spread(left, level);
+            return;
+        }
+        // Each thread copies a piece of the window to where the counts
+        // tree says its elements start in 'tmp'.
+        int base = this->counts.prefix(left / this->chunk_size);
+        int sz = this->count_interval(left, level);
+        tmp.resize(sz);
+        vtmp.resize(sz);
+        parallel_for(nt, [&](int t) {
+                int l = this->piece(left, e, t, nt), r = this->piece(left, e, t + 1, nt);
+                int j = this->counts.prefix(l / this->chunk_size) - base;
+                for (int i = this->present.next(l, r); i < r; i = this->present.next(i + 1, r)) {
+                    tmp[j] = this->impl[i];
+                    vtmp[j] = this->vals[i];
+                    ++j;
+                }
+            });
+        this->present.clear(left, e);
+        this->spread_tmp(left, level);
+    }
+
+    // Rebalance the window of level 'level' starting at 'left' and
+    // insert 'v' into it in the same pass. The window must hold v's
+    // slot and have room for it.
+    void
+    rebalance_insert(int left, int level, const Key &v, const mapped_type &x) {
+        int w = (1 << level) * this->chunk_size;
+        if (this->threads_for(w) > 1) {
+            this->rebalance_interval(left, level);
+            this->insert(v, x);
+            return;
+        }
+        this->spread_in_place(left, w, false, &v, x);
+        ++this->nelems;
+        this->finish_spread(left, level);
+    }
+
+    // Spread the elements in 'tmp' evenly over the (cleared) window of
+    // level 'level' starting at 'left'. With several threads, each
+    // fills a piece of the window.
+    void
+    spread_tmp(int left, int level) {
+        int w = (1 << level) * this->chunk_size;
+        int n = tmp.size();
+        dprintf("w: %d, tmp.size(): %d\n", w, n);
+        assert(n <= w);
+        int nt = this->threads_for(w);
+        if (nt == 1) {
+            this->spread_range(0, n, left, w);
+        } else {
+            parallel_for(nt, [&](int t) {
+                    int a = this->piece(left, left + w, t, nt);
+                    int b = this->piece(left, left + w, t + 1, nt);
+                    this->spread_range(this->first_spread_to(a, n, left, w),
+                                       this->first_spread_to(b, n, left, w), left, w);
+                });
+        }
+        this->finish_spread(left, level);
+    }
+
+    // Recount, reindex and (in gap-free mode) refill the window of
+    // level 'level' starting at 'left' after its elements moved.
+    void
+    finish_spread(int left, int level) {
+        int w = (1 << level) * this->chunk_size;
+        this->counts.rebuild(this->present, this->chunk_size, level, left / w);
+        this->refresh_index(left / this->chunk_size, (left + w) / this->chunk_size);
+        this->fill_gaps(left, left + w);
+        nmoves += w;
+    }
+
+    // The slot the i'th of 'n' elements spread evenly over the 'w'
+    // slots from 'left' goes to.
+    static int
+    spread_slot(int i, int n, int left, int w) {
+        return left + (int)((int64_t)i * w / n);
+    }
+
+    // Put tmp[i], i in [first, last), at its slot.
+    void
+    spread_range(int first, int last, int left, int w) {
+        int n = tmp.size();
+        for (int i = first; i < last; ++i) {
+            int k = spread_slot(i, n, left, w);
+            this->present.set(k);
+            this->impl[k] = tmp[i];
+            this->vals[k] = vtmp[i];
+        }
+    }
+
+    // The first i for which spread_range() puts tmp[i] at or after
+    // slot 'a' (n if there is none).
+    static int
+    first_spread_to(int a, int n, int left, int w) {
+        return std::min((int64_t)n, ((int64_t)(a - left) * n + w - 1) / w);
+    }
+
+    // Switch gap-free mode on or off. Switching it on fills every
+    // empty slot in O(n). The mode needs every slot of the array to
+    // be filled, so it resizes in one go instead of incrementally.
+    void
+    set_gap_free(bool on) {
+        this->finish_resize();
+        this->gap_free = on;
+        this->fill_gaps(0, this->impl.size());
+    }
+
+    // In gap-free mode, after the slots in [l, e) change, give each
+    // empty slot in it, and in the run of empty slots right after it,
+    // the key of the closest element before it.
+    void
+    fill_gaps(int l, int e) {
+        if (!this->gap_free) {
+            return;
+        }
+        // The empty slots before the first element take its key.
+        int p = this->present.prev(0, l);
+        if (p < 0) {
+            p = this->present.next(l, this->impl.size());
+            if (p == (int)this->impl.size()) {
+                return;
+            }
+            l = 0;
+        }
+        Key k = this->impl[p];
+        int end = this->present.next(e, this->impl.size());
+        for (int i = l; i < end; ++i) {
+            if (this->present[i]) {
+                k = this->impl[i];
+            } else {
+                this->impl[i] = k;
+            }
+        }
+        for (int c = l / this->chunk_size; c * this->chunk_size < end; ++c) {
+            this->touch(c);
+        }
+    }
+
+    void
+    insert(Key v, mapped_type x = mapped_type()) {
+        /*
+        if ((this->nelems + 2) * 2 > this->impl.size()) {
+            // resize array
+            this->resize(2 * this->impl.size());
+        }
+        */
+
+        if (this->migrating()) {
+            this->migrate_step();
+        }
+
+        int i = lower_bound(v);
+        if (i == (int)this->impl.size()) {
+            --i;
+        }
+        assert(i > -1);
+        assert(i < (int)this->impl.size());
+        if (this->adaptive) {
+            ++this->heat[i / this->chunk_size];
+        }
+
+        // Check in a window of size 'w'
+        int w = chunk_size;
+        int level = 0;
+        int l = this->left_interval_boundary(i, w);
+        this->migrate_window(l, w);
+
+        // Number of elements in current window. We just need sz to be
+        // less than w -- we don't need the exact value of 'sz' here.
+        int sz = w - 1;
+
+        bool in_limit = false;
+
+        // If the current chunk has space, then the last element will
+        // be unused (with significant probability). First check that
+        // as a quick check.
+        if (this->present[l + this->chunk_size - 1]) {
+            get_interval_stats(l, level, in_limit, sz);
+        }
+
+        if (sz < w) {
+            // There is some space in this interval. We can just
+            // shuffle elements and insert.
+            this->insert_merge(l, v, x);
+        } else {
+            // No space in this interval. Find an interval above this
+            // interval that is within limits, re-balance, and
+            // re-start insertion.
+            in_limit = false;
+            while (!in_limit) {
+                w *= 2;
+                level += 1;
+                // assert(level <= this->nlevels);
+                if (level > this->nlevels) {
+                    // Root node is out of balance. Resize array.
+                    this->finish_resize();
+                    if (this->impl.size() < MIN_INCREMENTAL_RESIZE || this->gap_free) {
+                        this->resize(Density::growth * this->impl.size());
+                    } else {
+                        this->start_resize(Density::growth * this->impl.size());
+                    }
+                    this->insert(v, x);
+                    return;
+                }
+
+                l = this->left_interval_boundary(i, w);
+                this->migrate_window(l, w);
+                get_interval_stats(l, level, in_limit, sz);
+                dprintf("level: %d, this->nlevels: %d, in_limit: %d, sz: %d\n", level, this->nlevels, in_limit, sz);
+            }
+            this->rebalance_insert(l, level, v, x);
+        }
+
+    } // insert(Key v)
+
+    // Insert the keys in [first, last). The keys are sorted (if they
+    // aren't already), and every run of keys that lands in the same
+    // window is merged into it with a single rebalance: we find the
+    // leaf of the run's first key, and climb until the window can
+    // take all the keys that belong in it.
+    template <typename Iter>
+    void
+    insert_batch(Iter first, Iter last) {
+        keys_t batch(first, last);
+        if (!std::is_sorted(batch.begin(), batch.end(), this->comp)) {
+            std::sort(batch.begin(), batch.end(), this->comp);
+        }
+        this->finish_resize();
+
+        // Keys are sorted, so each run's leaf is at or after the
+        // chunk 'from' where the previous run's window ended.
+        int pos = 0;
+        int from = 0;
+        while (pos < (int)batch.size()) {
+            int gap = (this->nchunks - from) / (batch.size() - pos);
+            int i = this->lower_bound_from(from, batch[pos], gap);
+            if (i == (int)this->impl.size()) {
+                --i;
+            }
+
+            int w = this->chunk_size;
+            int level = 0;
+            int l = this->left_interval_boundary(i, w);
+            int g, sz;
+            while (true) {
+                g = this->keys_for_window(batch, pos, l + w);
+                sz = this->count_interval(l, level);
+                if (sz + g <= (level == 0 ? w : this->max_elems_at(level))) {
+                    break;
+                }
+                w *= 2;
+                level += 1;
+                if (level > this->nlevels) {
+                    break;
+                }
+                l = this->left_interval_boundary(i, w);
+            }
+
+            if (level > this->nlevels) {
+                // Root node would be out of balance. Resize array.
+                this->resize(Density::growth * this->impl.size());
+                from = 0;
+                continue;
+            }
+            this->merge_interval(l, level, batch.begin() + pos, g);
+            pos += g;
+            from = (l + w) / this->chunk_size;
+        }
+    }
+
+    // lower_bound() over the chunks from 'from' onwards. We gallop
+    // from 'from' first, in steps starting at 'gap' (the expected
+    // distance in chunks), so that a key close to 'from' costs
+    // O(log distance) probes instead of O(log n).
+    int
+    lower_bound_from(int from, const Key &v, int gap = 1) {
+        int n = this->nchunks - from;
+        if (this->nelems == 0 || n == 0) {
+            return this->impl.size();
+        }
+        int bound = std::max(gap, 1);
+        while (bound < n && this->probe_chunk(from + bound - 1, v) <= 0) {
+            bound *= 2;
+        }
+        n = std::min(bound, n);
+        int c = from + this->search_chunks(n, [&](int m) {
+                return this->probe_chunk(from + m, v);
+            });
+        return c * this->chunk_size;
+    }
+
+    // Number of keys in batch[pos...] that belong at or before slot
+    // 'end', i.e. that are <= the first element after 'end'.
+    int
+    keys_for_window(const keys_t &batch, int pos, int end) {
+        end = this->present.next(end, this->impl.size());
+        if (end == (int)this->impl.size()) {
+            return batch.size() - pos;
+        }
+        return std::upper_bound(batch.begin() + pos, batch.end(), this->impl[end], this->comp) -
+            (batch.begin() + pos);
+    }
+
+    // Merge the 'g' sorted keys at 'keys' into the window of level
+    // 'level' starting at 'left', and spread the result. The new keys
+    // get default values.
+    void
+    merge_interval(int left, int level, typename keys_t::const_iterator keys, int g) {
+        dprintf("merge_interval(%d, %d, %d)\n", left, level, g);
+        int w = (1 << level) * this->chunk_size;
+        tmp.clear();
+        tmp.reserve(w);
+        vtmp.clear();
+        vtmp.reserve(w);
+        int k = 0;
+        int e = left + w;
+        for (int i = this->present.next(left, e); i < e; i = this->present.next(i + 1, e)) {
+            while (k < g && this->comp(keys[k], this->impl[i])) {
+                tmp.push_back(keys[k++]);
+                vtmp.push_back(mapped_type());
+            }
+            tmp.push_back(this->impl[i]);
+            vtmp.push_back(this->vals[i]);
+        }
+        this->present.clear(left, e);
+        for (; k < g; ++k) {
+            tmp.push_back(keys[k]);
+            vtmp.push_back(mapped_type());
+        }
+        this->nelems += g;
+        this->spread_tmp(left, level);
+    }
+
+    // Halve the array till it is at least as full as the lower
+    // threshold at the root allows (1/4 by default) and every chunk
+    // can get an element.
+    void
+    shrink() {
+        this->finish_resize();
+        int capacity = this->impl.size();
+        while (capacity > 2 &&
+               (this->nelems < Density::min_elems(capacity) ||
+                this->nelems < capacity / chunk_size_for(capacity))) {
+            capacity /= 2;
+        }
+        if (capacity < (int)this->impl.size()) {
+            this->resize(capacity);
+        }
+    }
+
+    // Remove the element at index 'i' of 'impl'. If its chunk becomes
+    // too sparse, we rebalance the smallest enclosing window that is
+    // within the lower threshold, and halve the array if even the
+    // root isn't.
+    void
+    erase_at(int i) {
+        assert(this->present[i]);
+        this->present.reset(i);
+        this->counts.add(i / this->chunk_size, -1);
+        this->refresh_index(i / this->chunk_size, i / this->chunk_size + 1);
+        this->fill_gaps(i, i + 1);
+        --this->nelems;
+
+        if (this->nelems < this->min_elems_at(this->nlevels)) {
+            this->shrink();
+            return;
+        }
+
+        int w = this->chunk_size;
+        int level = 0;
+        int l = this->left_interval_boundary(i, w);
+        int sz;
+        bool in_limit = false;
+
+        get_interval_lower_stats(l, level, in_limit, sz);
+        while (!in_limit) {
+            w *= 2;
+            level += 1;
+            if (level > this->nlevels) {
+                // Root node is too sparse. Shrink the array.
+                this->shrink();
+                return;
+            }
+            l = this->left_interval_boundary(i, w);
+            this->migrate_window(l, w);
+            get_interval_lower_stats(l, level, in_limit, sz);
+        }
+        if (level > 0) {
+            this->rebalance_interval(l, level);
+        }
+    }
+
+    // Remove one occurrence of 'v'. Returns false if 'v' isn't in the
+    // PMA.
+    bool
+    erase(const Key &v) {
+        if (this->migrating()) {
+            this->migrate_step();
+        }
+        int i = this->lower_bound(v);
+        if (i == (int)this->impl.size()) {
+            return false;
+        }
+        int j = this->lb_in_chunk(i, v);
+        if (j == i + this->chunk_size || this->comp(v, this->impl[j])) {
+            return false;
+        }
+        this->erase_at(j);
+        return true;
+    }
+
+    int
+    size() const {
+        return this->nelems;
+    }
+
+    iterator
+    begin() {
+        this->finish_resize();
+        return iterator(this, this->present.next(0, this->impl.size()));
+    }
+
+    iterator
+    end() {
+        this->finish_resize();
+        return iterator(this, this->impl.size());
+    }
+
+    // Slot of the first element >= 'v', or impl.size() if there is
+    // none.
+    int
+    lower_bound_slot(const Key &v) {
+        int i = this->lower_bound(v);
+        if (i == (int)this->impl.size()) {
+            return i;
+        }
+        int j = this->lb_in_chunk(i, v);
+        return j < i + this->chunk_size ? j : this->present.next(j, this->impl.size());
+    }
+
+    // The elements >= lo and < hi, for a range-for loop.
+    PMARange
+    range(const Key &lo, const Key &hi) {
+        this->finish_resize();
+        int l = this->lower_bound_slot(lo);
+        int h = this->comp(lo, hi) ? this->lower_bound_slot(hi) : l;
+        return PMARange(iterator(this, l), iterator(this, h));
+    }
+
+    // Number of elements before slot 'i', in O(log n).
+    int
+    rank(int i) const {
+        int c = i / this->chunk_size;
+        return this->counts.prefix(c) + this->present.count(c * this->chunk_size, i);
+    }
+
+    // Number of elements >= lo and < hi.
+    int
+    count_range(const Key &lo, const Key &hi) {
+        this->finish_resize();
+        if (!this->comp(lo, hi)) {
+            return 0;
+        }
+        return this->rank(this->lower_bound_slot(hi)) - this->rank(this->lower_bound_slot(lo));
+    }
+
+    // Call f(a, words, n) for the whole bitmap words in the slots [l, h)
+    // (a is the key of the first slot), and edge(i) for every element
+    // in the partial words at either end.
+    template <typename Words, typename Edge>
+    void
+    scan_words(int l, int h, Words f, Edge edge) {
+        int wl = (l + 63) >> 6, wh = h >> 6;
+        if (wl > wh) {
+            // [l, h) is inside one word
+            for (int i = this->present.next(l, h); i < h; i = this->present.next(i + 1, h)) {
+                edge(i);
+            }
+            return;
+        }
+        for (int i = this->present.next(l, wl << 6); i < wl << 6; i = this->present.next(i + 1, wl << 6)) {
+            edge(i);
+        }
+        if (wl < wh) {
+            f(this->impl.data() + (wl << 6), this->present.words.data() + wl, wh - wl);
+        }
+        for (int i = this->present.next(wh << 6, h); i < h; i = this->present.next(i + 1, h)) {
+            edge(i);
+        }
+    }
+
+    // Sum of the elements >= lo and < hi, for arithmetic keys.
+    typename sum_of<Key>::type
+    sum_range(const Key &lo, const Key &hi) {
+        this->finish_resize();
+        typename sum_of<Key>::type s = 0;
+        if (!this->comp(lo, hi)) {
+            return s;
+        }
+        this->scan_words(this->lower_bound_slot(lo), this->lower_bound_slot(hi),
+                         [&](const Key *a, const uint64_t *w, int n) {
+                             s += agg_kernels<Key>::sum(a, w, n);
+                         },
+                         [&](int i) { s += this->impl[i]; });
+        return s;
+    }
+
+    // Smallest and largest element >= lo and < hi, for arithmetic
+    // keys. Returns false if there is none.
+    bool
+    min_max_range(const Key &lo, const Key &hi, Key &mn, Key &mx) {
+        this->finish_resize();
+        if (!this->comp(lo, hi)) {
+            return false;
+        }
+        int l = this->lower_bound_slot(lo), h = this->lower_bound_slot(hi);
+        if (this->present.next(l, h) == h) {
+            return false;
+        }
+        mn = std::numeric_limits<Key>::max();
+        mx = std::numeric_limits<Key>::lowest();
+        this->scan_words(l, h,
+                         [&](const Key *a, const uint64_t *w, int n) {
+                             agg_kernels<Key>::min_max(a, w, n, mn, mx);
+                         },
+                         [&](int i) {
+                             mn = std::min(mn, this->impl[i]);
+                             mx = std::max(mx, this->impl[i]);
+                         });
+        return true;
+    }
+
+    // Write the elements >= lo and < hi for which pred(key) holds to
+    // 'out', in order, and return how many there were. A whole word
+    // evaluates 'pred' on all its 64 slots into a mask (a loop the
+    // compiler can vectorize for simple predicates), and the mask of
+    // the elements picks the ones to write.
+    template <typename Pred, typename Out>
+    int
+    select_where(const Key &lo, const Key &hi, Pred pred, Out out) {
+        this->finish_resize();
+        if (!this->comp(lo, hi)) {
+            return 0;
+        }
+        return this->select_slots(this->lower_bound_slot(lo), this->lower_bound_slot(hi), pred, out);
+    }
+
+    // select_where() over every element.
+    template <typename Pred, typename Out>
+    int
+    select_where(Pred pred, Out out) {
+        this->finish_resize();
+        return this->select_slots(0, this->impl.size(), pred, out);
+    }
+
+    template <typename Pred, typename Out>
+    int
+    select_slots(int l, int h, Pred pred, Out &out) {
+        int n = 0;
+        this->scan_words(l, h,
+                         [&](const Key *a, const uint64_t *w, int nw) {
+                             for (int k = 0; k < nw; ++k, a += 64) {
+                                 uint64_t m = 0;
+                                 for (int j = 0; j < 64; ++j) {
+                                     m |= (uint64_t)(bool)pred(a[j]) << j;
+                                 }
+                                 m &= w[k];
+                                 n += __builtin_popcountll(m);
+                                 for (; m; m &= m - 1) {
+                                     *out++ = a[__builtin_ctzll(m)];
+                                 }
+                             }
+                         },
+                         [&](int i) {
+                             if (pred(this->impl[i])) {
+                                 *out++ = this->impl[i];
+                                 ++n;
+                             }
+                         });
+        return n;
+    }
+
+    void
+    prefetch_ahead(int i) const {
+        int k = i + SCAN_PREFETCH_CHUNKS * this->chunk_size;
+        if (k < (int)this->impl.size()) {
+            // The 64 slots of the bitmap word that 'k' is in
+            const char *p = (const char*)(this->impl.data() + (k & ~63));
+            for (int b = 0; b < 64 * (int)sizeof(Key); b += 64) {
+                __builtin_prefetch(p + b);
+            }
+        }
+    }
+
+    // Call f(key) for every element >= lo and < hi, in order. We go a
+    // bitmap word (64 slots) at a time: a full word is a plain loop
+    // over 64 keys that the compiler can unroll and vectorize, any
+    // other word visits its set bits.
+    template <typename F>
+    void
+    for_each_in_range(const Key &lo, const Key &hi, F f) {
+        this->finish_resize();
+        if (!this->comp(lo, hi)) {
+            return;
+        }
+        int l = this->lower_bound_slot(lo);
+        int h = this->lower_bound_slot(hi);
+        const Key *a = this->impl.data();
+        for (int w = l >> 6; w << 6 < h; ++w) {
+            this->prefetch_ahead(w << 6);
+            uint64_t bits = this->present.words[w];
+            int base = w << 6;
+            if (base < l) {
+                bits &= ~bitmap::mask_below(l - base);
+            }
+            if (base + 64 > h) {
+                bits &= bitmap::mask_below(h - base);
+            }
+            if (bits == ~(uint64_t)0) {
+                for (int j = 0; j < 64; ++j) {
+                    f(a[base + j]);
+                }
+                continue;
+            }
+            while (bits) {
+                f(a[base + __builtin_ctzll(bits)]);
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    // The header of the file save() writes now, with 'seq' (see
+    // pma_file_header).
+    pma_file_header
+    file_header(int64_t seq = 0) const {
+        int capacity = this->impl.size();
+        pma_file_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, PMA_FILE_MAGIC, sizeof(h.magic));
+        h.version = PMA_FILE_VERSION;
+        h.key_size = sizeof(Key);
+        h.capacity = capacity;
+        h.chunk_size = this->chunk_size;
+        h.nlevels = this->nlevels;
+        h.nelems = this->nelems;
+        h.gap_free = this->gap_free;
+        h.seq = seq;
+        int64_t bytes[4] = { (int64_t)sizeof(Key) * capacity,
+                             (int64_t)sizeof(uint64_t) * ((capacity + 63) / 64),
+                             (int64_t)sizeof(int) * 2 * this->nchunks,
+                             (int64_t)sizeof(Key) * (this->nchunks + 1) };
+        int64_t *off[4] = { &h.impl_off, &h.present_off, &h.counts_off, &h.index_off };
+        int64_t end = sizeof(h);
+        for (int k = 0; k < 4; ++k) {
+            *off[k] = (end + PMA_FILE_ALIGN - 1) / PMA_FILE_ALIGN * PMA_FILE_ALIGN;
+            end = *off[k] + bytes[k];
+        }
+        h.file_size = end;
+        return h;
+    }
+
+    // Write the PMA to 'path' in the format of pma_file_header. The
+    // file is written and synced next to 'path' and renamed over it,
+    // so 'path' is either the old file or the new one. Returns false
+    // on an I/O error.
+    bool
+    save(const char *path, int64_t seq = 0) {
+        static_assert(std::is_trivially_copyable<Key>::value, "save() writes the keys' bytes");
+        static_assert(std::is_same<Values, no_values>::value, "save() writes keys only");
+        this->finish_resize();
+        pma_file_header h = this->file_header(seq);
+        const void *data[4] = { this->impl.data(), this->present.words.data(),
+                                this->counts.cnt.data(), this->index.key.data() };
+        int64_t off[4] = { h.impl_off, h.present_off, h.counts_off, h.index_off };
+        int64_t bytes[4] = { (int64_t)sizeof(Key) * (int64_t)this->impl.size(),
+                             (int64_t)sizeof(uint64_t) * (int64_t)this->present.words.size(),
+                             (int64_t)sizeof(int) * (int64_t)this->counts.cnt.size(),
+                             (int64_t)sizeof(Key) * this->nchunks };
+
+        std::string tmp_path = std::string(path) + ".tmp";
+        FILE *f = fopen(tmp_path.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+        for (int k = 0; ok && k < 4; ++k) {
+            ok = fseek(f, off[k], SEEK_SET) == 0 &&
+                fwrite(data[k], 1, bytes[k], f) == (size_t)bytes[k];
+        }
+        ok = ok && fwrite(&this->index.last, sizeof(Key), 1, f) == 1;
+        ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp_path.c_str(), path) != 0) {
+            remove(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void
+    print() {
+        this->finish_resize();
+        for (int i = 0; i < (int)this->impl.size(); ++i) {
+            cout.width(3);
+            if (this->present[i]) {
+                cout << this->impl[i] << " ";
+            } else {
+                cout << -1 << " ";
+            }
+        }
+        cout << endl;
+    }
+
+};
+
+template <typename Iter>
+bool
+is_sorted(Iter f, Iter l) {
+    Iter next = f;
+    while (f != l) {
+        ++next;
+        if (next != l && *f > *next) {
+            return false;
+        }
+        f = next;
+    }
+    return true;
+}
+
+#endif // PMA_HPP
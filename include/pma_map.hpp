@@ -0,0 +1,73 @@
+#if !defined PMA_MAP_HPP
+#define PMA_MAP_HPP
+
+#include "pma.hpp"
+
+// An ordered map from unique keys to values on top of the PMA. Keys
+// and values live in parallel arrays ('impl' and 'vals') that are
+// rebalanced in lockstep, so lookups only touch the keys and the
+// value array is read once, at the slot that was found.
+template <typename K, typename V, typename Compare = std::less<K> >
+struct PMAMap : PMA<K, Compare, arena_allocator<K>, vector<V, arena_allocator<V> > > {
+    typedef PMA<K, Compare, arena_allocator<K>, vector<V, arena_allocator<V> > > base;
+
+    PMAMap(int capacity = 2, const Compare &c = Compare())
+        : base(capacity, c)
+    { }
+
+    // Slot of 'k' in 'impl', or -1 if 'k' isn't in the map.
+    int
+    find_slot(const K &k) {
+        int j = this->lower_bound_slot(k);
+        if (j == (int)this->impl.size() || this->comp(k, this->impl[j])) {
+            return -1;
+        }
+        return j;
+    }
+
+    // Pointer to the value of 'k' (NULL if 'k' isn't in the map). It
+    // can be used to update the value in place, but stays valid only
+    // until the next insert or erase.
+    V*
+    find(const K &k) {
+        int j = this->find_slot(k);
+        return j < 0 ? NULL : &this->vals[j];
+    }
+
+    bool
+    contains(const K &k) {
+        return this->find_slot(k) >= 0;
+    }
+
+    // Set the value of 'k' to 'v'. Returns true if 'k' was inserted,
+    // false if it was already there.
+    bool
+    insert_or_assign(const K &k, const V &v) {
+        int j = this->find_slot(k);
+        if (j >= 0) {
+            this->vals[j] = v;
+            return false;
+        }
+        this->insert(k, v);
+        return true;
+    }
+
+    // The value of 'k', which is inserted with V() if it isn't in the
+    // map yet.
+    V&
+    operator[](const K &k) {
+        int j = this->find_slot(k);
+        if (j < 0) {
+            this->insert(k, V());
+            j = this->find_slot(k);
+        }
+        return this->vals[j];
+    }
+
+    V&
+    value(typename base::iterator it) {
+        return this->vals[it.i];
+    }
+};
+
+#endif // PMA_MAP_HPP
@@ -0,0 +1,136 @@
+#if !defined PMA_POLICY_HPP
+#define PMA_POLICY_HPP
+
+#include <vector>
+#include <algorithm>
+#include "arena.hpp"
+
+// The density thresholds and growth factor of a PMA. Thresholds are
+// given in thousandths and go linearly with the level of a window,
+// from 'UpperLeaf' and 'LowerLeaf' at the chunks (level 0) to
+// 'UpperRoot' and 'LowerRoot' at the root (level 'nlevels'; an array
+// of one chunk uses the leaf thresholds). A full root grows the array
+// 'Growth' times; an array that is shrunk is halved until it is at
+// least 'LowerRoot' full.
+template <int UpperLeaf = 1000, int UpperRoot = 500, int LowerLeaf = 125, int LowerRoot = 250,
+          int Growth = 2>
+struct density_policy {
+    static_assert(Growth >= 2 && !(Growth & (Growth - 1)), "Growth must be a power of 2");
+    static_assert(LowerLeaf <= LowerRoot && LowerRoot < UpperRoot && UpperRoot <= UpperLeaf &&
+                  UpperLeaf <= 1000, "thresholds must be ordered");
+    // A root that just grew must not be below its lower threshold.
+    static_assert(LowerRoot * Growth <= UpperRoot, "Growth is too large for the thresholds");
+
+    static const int growth = Growth;
+
+    static double
+    upper(int level, int nlevels) {
+        if (nlevels == 0) {
+            return UpperLeaf / 1000.0;
+        }
+        return UpperLeaf / 1000.0 - ((UpperLeaf - UpperRoot) / 1000.0 * level) / nlevels;
+    }
+
+    static double
+    lower(int level, int nlevels) {
+        if (nlevels == 0) {
+            return LowerLeaf / 1000.0;
+        }
+        return LowerLeaf / 1000.0 + ((LowerRoot - LowerLeaf) / 1000.0 * level) / nlevels;
+    }
+
+    // Fewest elements an array of 'capacity' slots is shrunk to hold.
+    static int
+    min_elems(int capacity) {
+        return (long long)capacity * LowerRoot / 1000;
+    }
+};
+
+typedef density_policy<> default_density;
+
+// The chunk size of an array of 'capacity' slots of 'Key's (a power
+// of 2): here log2(capacity) times 'Scale', rounded down to a power
+// of 2.
+template <int Scale = 2>
+struct log_geometry {
+    static_assert(Scale >= 1, "Scale must be positive");
+
+    template <typename Key>
+    static int
+    chunk_size(int capacity) {
+        return std::min(capacity, 1 << lg(lg(capacity) * Scale));
+    }
+
+    static int
+    lg(int n) {
+        return 31 - __builtin_clz(n);
+    }
+};
+
+typedef log_geometry<> default_geometry;
+
+// Chunks of a fixed 'Bytes' bytes (fewer slots if the array is
+// smaller), whatever the capacity. arena_allocator starts arrays of a
+// page or more on a page and smaller ones on a cache line, so with it
+// every chunk of up to a page covers exactly Bytes/ARENA_LINE cache
+// lines: searching a chunk or inserting into one touches those lines
+// and the bitmap word(s) of its slots, no matter how large the array
+// gets.
+template <int Bytes>
+struct byte_geometry {
+    static_assert(Bytes > 0 && !(Bytes & (Bytes - 1)), "Bytes must be a power of 2");
+
+    template <typename Key>
+    static int
+    chunk_size(int capacity) {
+        int n = std::max(1, Bytes / (int)sizeof(Key));
+        return std::min(capacity, 1 << log_geometry<>::lg(n));
+    }
+};
+
+// Chunks of 'Lines' cache lines, or of one page.
+template <int Lines = 1>
+using line_geometry = byte_geometry<Lines * ARENA_LINE>;
+typedef byte_geometry<ARENA_PAGE> page_geometry;
+
+// The thresholds of a Density policy as element counts for each level
+// of windows over chunks of 'chunk_size' slots, so that checking a
+// window is an integer compare.
+struct density_limits {
+    // A window of level 'level' is within its upper threshold while it
+    // holds at most max[level] elements, and within its lower one
+    // while it holds at least min[level].
+    std::vector<int> max;
+    std::vector<int> min;
+
+    template <typename Density>
+    void
+    init(int chunk_size, int nlevels) {
+        this->max.resize(nlevels + 1);
+        this->min.resize(nlevels + 1);
+        for (int level = 0; level <= nlevels; ++level) {
+            double w = (double)chunk_size * (1 << level);
+            double t = Density::upper(level, nlevels);
+            int c = t * w;
+            while (c > 0 && !(c / w < t)) {
+                --c;
+            }
+            while ((c + 1) / w < t) {
+                ++c;
+            }
+            this->max[level] = c;
+
+            t = Density::lower(level, nlevels);
+            c = t * w;
+            while (c > 0 && (c - 1) / w >= t) {
+                --c;
+            }
+            while (!(c / w >= t)) {
+                ++c;
+            }
+            this->min[level] = c;
+        }
+    }
+};
+
+#endif // PMA_POLICY_HPP
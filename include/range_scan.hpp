@@ -0,0 +1,172 @@
+#if !defined RANGE_SCAN_HPP
+#define RANGE_SCAN_HPP
+
+#include <stdint.h>
+#include <limits>
+#include <type_traits>
+#include "chunk_search.hpp"
+
+// Kernels that aggregate the occupied slots of 'n' whole bitmap words:
+// words[i] covers the 64 keys at a + 64*i. The keys of empty slots
+// are loaded too and masked off, so there is no branch per slot. For
+// 4-byte signed keys the AVX2 kernels are picked at startup (unless
+// CHUNK_SEARCH_SCALAR is defined); the scalar kernels are written as
+// selects the compiler can vectorize.
+
+// The type sums of K are accumulated in.
+template <typename K>
+struct sum_of {
+    typedef typename std::conditional<
+        std::is_floating_point<K>::value, double,
+        typename std::conditional<std::is_signed<K>::value,
+                                  long long, unsigned long long>::type>::type type;
+};
+
+template <typename K>
+typename sum_of<K>::type
+masked_sum_scalar(const K *a, const uint64_t *words, int n) {
+    typename sum_of<K>::type s = 0;
+    for (int i = 0; i < n; ++i, a += 64) {
+        uint64_t bits = words[i];
+        if (bits == ~(uint64_t)0) {
+            for (int j = 0; j < 64; ++j) {
+                s += a[j];
+            }
+        } else {
+            for (int j = 0; j < 64; ++j) {
+                s += (bits >> j) & 1 ? a[j] : K();
+            }
+        }
+    }
+    return s;
+}
+
+// Folds the keys into 'mn' and 'mx', which the caller initializes.
+template <typename K>
+void
+masked_min_max_scalar(const K *a, const uint64_t *words, int n, K &mn, K &mx) {
+    const K hi = std::numeric_limits<K>::max();
+    const K lo = std::numeric_limits<K>::lowest();
+    K x = mn, y = mx;
+    for (int i = 0; i < n; ++i, a += 64) {
+        uint64_t bits = words[i];
+        for (int j = 0; j < 64; ++j) {
+            bool b = (bits >> j) & 1;
+            x = std::min(x, b ? a[j] : hi);
+            y = std::max(y, b ? a[j] : lo);
+        }
+    }
+    mn = x;
+    mx = y;
+}
+
+#if defined CHUNK_SEARCH_X86
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+// Lane j of the result is all ones if bit j of 'b' is set.
+AVX2_TARGET static inline __m256i
+lane_mask8(unsigned b) {
+    const __m256i sel = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(b), sel), sel);
+}
+
+template <typename K>
+AVX2_TARGET long long
+masked_sum_avx2(const K *a, const uint64_t *words, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < n; ++i, a += 64) {
+        uint64_t bits = words[i];
+        for (int g = 0; g < 64; g += 8) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(a + g));
+            x = _mm256_and_si256(x, lane_mask8((bits >> g) & 0xff));
+            acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(x)));
+            acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(x, 1)));
+        }
+    }
+    long long s[4];
+    _mm256_storeu_si256((__m256i*)s, acc);
+    return s[0] + s[1] + s[2] + s[3];
+}
+
+template <typename K>
+AVX2_TARGET void
+masked_min_max_avx2(const K *a, const uint64_t *words, int n, K &mn, K &mx) {
+    const __m256i hi = _mm256_set1_epi32(INT32_MAX);
+    const __m256i lo = _mm256_set1_epi32(INT32_MIN);
+    __m256i x = _mm256_set1_epi32(mn), y = _mm256_set1_epi32(mx);
+    for (int i = 0; i < n; ++i, a += 64) {
+        uint64_t bits = words[i];
+        for (int g = 0; g < 64; g += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(a + g));
+            __m256i m = lane_mask8((bits >> g) & 0xff);
+            x = _mm256_min_epi32(x, _mm256_blendv_epi8(hi, v, m));
+            y = _mm256_max_epi32(y, _mm256_blendv_epi8(lo, v, m));
+        }
+    }
+    int32_t xs[8], ys[8];
+    _mm256_storeu_si256((__m256i*)xs, x);
+    _mm256_storeu_si256((__m256i*)ys, y);
+    for (int j = 0; j < 8; ++j) {
+        mn = std::min(mn, (K)xs[j]);
+        mx = std::max(mx, (K)ys[j]);
+    }
+}
+
+#undef AVX2_TARGET
+#endif
+
+template <typename K>
+struct agg_kernel {
+    typedef typename sum_of<K>::type (*sum_fn)(const K *, const uint64_t *, int);
+    typedef void (*min_max_fn)(const K *, const uint64_t *, int, K &, K &);
+};
+
+template <typename K, typename C>
+typename agg_kernel<K>::sum_fn
+pick_masked_sum(C *) {
+    return masked_sum_scalar<K>;
+}
+
+template <typename K, typename C>
+typename agg_kernel<K>::min_max_fn
+pick_masked_min_max(C *) {
+    return masked_min_max_scalar<K>;
+}
+
+#if defined CHUNK_SEARCH_X86 && !defined CHUNK_SEARCH_SCALAR
+template <typename K>
+typename agg_kernel<K>::sum_fn
+pick_masked_sum(int32_t *) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return masked_sum_avx2<K>;
+    }
+    return masked_sum_scalar<K>;
+}
+
+template <typename K>
+typename agg_kernel<K>::min_max_fn
+pick_masked_min_max(int32_t *) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return masked_min_max_avx2<K>;
+    }
+    return masked_min_max_scalar<K>;
+}
+#endif
+
+template <typename K>
+struct agg_kernels {
+    static const typename agg_kernel<K>::sum_fn sum;
+    static const typename agg_kernel<K>::min_max_fn min_max;
+};
+
+template <typename K>
+const typename agg_kernel<K>::sum_fn agg_kernels<K>::sum =
+    pick_masked_sum<K>((typename simd_key<K>::type*)0);
+
+template <typename K>
+const typename agg_kernel<K>::min_max_fn agg_kernels<K>::min_max =
+    pick_masked_min_max<K>((typename simd_key<K>::type*)0);
+
+#endif // RANGE_SCAN_HPP